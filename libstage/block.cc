@@ -1,5 +1,6 @@
 #include "region.hh"
 #include "worldfile.hh"
+#include <iterator> // for std::back_inserter
 
 using namespace Stg;
 using std::vector;
@@ -7,40 +8,35 @@ using std::vector;
 static void canonicalize_winding(vector<point_t> &pts);
 
 /** Create a new block. A model's body is a list of these
-    blocks. The point data is copied, so pts can safely be freed
-    after calling this.*/
-Block::Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &zrange)
-    : group(group), pts(pts), local_z(zrange), global_z(), rendered_cells()
+    blocks. The block's shape is kept in its group's geometry.*/
+Block::Block(BlockGroup *group, unsigned int index)
+    : group(group), index(index), global_z(), rendered_cells()
 {
   assert(group);
-  // canonicalize_winding(this->pts);
-}
-
-/** A from-file  constructor */
-Block::Block(BlockGroup *group, Worldfile *wf, int entity)
-    : group(group), pts(), local_z(), global_z(), rendered_cells()
-{
-  assert(group);
-  assert(wf);
-  assert(entity);
-
-  Load(wf, entity);
 }
 
 Block::~Block()
 {
   UnMap(0);
   UnMap(1);
+  UnMap(STATIC_LAYER);
+}
+
+BlockShape &Block::MutableShape()
+{
+  group->Unshare();
+  group->geometry->dirty = true; // force redraw
+  return group->geometry->shapes[index];
 }
 
 void Block::Translate(double x, double y)
 {
-  FOR_EACH (it, pts) {
+  BlockShape &shape = MutableShape();
+
+  FOR_EACH (it, shape.pts) {
     it->x += x;
     it->y += y;
   }
-
-  group->BuildDisplayList();
 }
 
 /** Return the value half way between the min and max Y position of
@@ -52,7 +48,7 @@ double Block::CenterY()
   double min = billion;
   double max = -billion;
 
-  FOR_EACH (it, pts) {
+  FOR_EACH (it, Shape().pts) {
     if (it->y > max)
       max = it->y;
     if (it->y < min)
@@ -72,7 +68,7 @@ double Block::CenterX()
   double min = billion;
   double max = -billion;
 
-  FOR_EACH (it, pts) {
+  FOR_EACH (it, Shape().pts) {
     if (it->x > max)
       max = it->x;
     if (it->x < min)
@@ -106,24 +102,24 @@ void Block::SetCenterX(double x)
 
 void Block::SetZ(double min, double max)
 {
-  local_z.min = min;
-  local_z.max = max;
-
-  // force redraw
-  group->BuildDisplayList();
+  BlockShape &shape = MutableShape();
+  shape.local_z.min = min;
+  shape.local_z.max = max;
 }
 
 void Block::AppendTouchingModels(std::set<Model *> &touchers)
 {
-  unsigned int layer = group->mod.world->updates % 2;
+  const unsigned int layer = group->mod.world->updates % 2;
+  const unsigned int layers[2] = { layer, STATIC_LAYER };
 
   // for every cell we are rendered into
-  FOR_EACH (cell_it, rendered_cells[layer])
-    // for every block rendered into that cell
-    FOR_EACH (block_it, (*cell_it)->GetBlocks(layer)) {
-      if (!group->mod.IsRelated(&(*block_it)->group->mod))
-        touchers.insert(&(*block_it)->group->mod);
-    }
+  FOR_EACH (cell_it, rendered_cells[group->mod.static_map ? STATIC_LAYER : layer])
+    // for every block rendered into that cell, moving or static
+    for (unsigned int l = 0; l < 2; ++l)
+      FOR_EACH (block_it, (*cell_it)->GetBlocks(layers[l])) {
+        if (!group->mod.IsRelated(&(*block_it)->group->mod))
+          touchers.insert(&(*block_it)->group->mod);
+      }
 }
 
 Model *Block::TestCollision()
@@ -137,28 +133,30 @@ Model *Block::TestCollision()
     if (global_z.min < 0)
       return group->mod.world->GetGround();
 
-    unsigned int layer = group->mod.world->updates % 2;
+    const unsigned int layer = group->mod.world->updates % 2;
+    const unsigned int layers[2] = { layer, STATIC_LAYER };
 
     // for every cell we may be rendered into
-    FOR_EACH (cell_it, rendered_cells[layer]) {
-      // for every block rendered into that cell
-      FOR_EACH (block_it, (*cell_it)->GetBlocks(layer)) {
-        Block *testblock = *block_it;
-        Model *testmod = &testblock->group->mod;
-
-        // printf( "   testing block %p of model %s\n", testblock,
-        // testmod->Token() );
-
-        // if the tested model is an obstacle and it's not attached to this
-        // model
-        if ((testmod != &group->mod) && testmod->vis.obstacle_return
-            && (!group->mod.IsRelated(testmod)) &&
-            // also must intersect in the Z range
-            testblock->global_z.min <= global_z.max && testblock->global_z.max >= global_z.min) {
-          // puts( "HIT");
-          return testmod; // bail immediately with the bad news
+    FOR_EACH (cell_it, rendered_cells[group->mod.static_map ? STATIC_LAYER : layer]) {
+      // for every block rendered into that cell, moving or static
+      for (unsigned int l = 0; l < 2; ++l)
+        FOR_EACH (block_it, (*cell_it)->GetBlocks(layers[l])) {
+          Block *testblock = *block_it;
+          Model *testmod = &testblock->group->mod;
+
+          // printf( "   testing block %p of model %s\n", testblock,
+          // testmod->Token() );
+
+          // if the tested model is an obstacle and it's not attached to this
+          // model
+          if ((testmod != &group->mod) && testmod->vis.obstacle_return
+              && (!group->mod.IsRelated(testmod)) &&
+              // also must intersect in the Z range
+              testblock->global_z.min <= global_z.max && testblock->global_z.max >= global_z.min) {
+            // puts( "HIT");
+            return testmod; // bail immediately with the bad news
+          }
         }
-      }
     }
   }
 
@@ -171,13 +169,25 @@ void Block::Map(unsigned int layer)
 {
   // calculate the global pixel coords of the block vertices
   // and render this block's polygon into the world
-  group->mod.world->MapPoly(group->mod.LocalToPixels(pts), this, layer);
+  rendered_pts[layer] = group->mod.LocalToPixels(Shape().pts);
+  group->mod.world->MapPoly(rendered_pts[layer], this, layer);
 
-  // update the block's absolute z bounds at this rendering
-  Pose gpose(group->mod.GetGlobalPose());
-  gpose.z += group->mod.geom.pose.z;
-  global_z.min = local_z.min + gpose.z;
-  global_z.max = local_z.max + gpose.z;
+  UpdateGlobalZ();
+}
+
+void Block::PrepareMap(std::vector<point_int_t> &pts, std::vector<point_int_t> &pixels) const
+{
+  pts = group->mod.LocalToPixels(Shape().pts);
+  World::PolyPixels(pts, pixels);
+}
+
+void Block::FinishMap(unsigned int layer, const std::vector<point_int_t> &pts,
+                      const std::vector<Cell *> &cells)
+{
+  rendered_pts[layer] = pts;
+  rendered_cells[layer] = cells;
+
+  UpdateGlobalZ();
 }
 
 void Block::UnMap(unsigned int layer)
@@ -186,6 +196,54 @@ void Block::UnMap(unsigned int layer)
     (*it)->RemoveBlock(this, layer);
 
   rendered_cells[layer].clear();
+  rendered_pts[layer].clear();
+}
+
+void Block::ReMap(unsigned int layer)
+{
+  World &world(*group->mod.world);
+  World::MapScratch &scratch(world.map_scratch[World::CurrentThread()]);
+
+  group->mod.LocalToPixels(Shape().pts, scratch.pts);
+
+  // most moves are smaller than a cell, so often there is nothing to do
+  if (scratch.pts != rendered_pts[layer]) {
+    World::PolyPixels(scratch.pts, scratch.pixels);
+    world.PixelCells(scratch.pixels, scratch.cells);
+
+    // both lists of cells are sorted
+    const std::vector<Cell *> &cells(scratch.cells), &old(rendered_cells[layer]);
+    scratch.added.clear();
+    scratch.removed.clear();
+    std::set_difference(cells.begin(), cells.end(), old.begin(), old.end(),
+                        std::back_inserter(scratch.added));
+    std::set_difference(old.begin(), old.end(), cells.begin(), cells.end(),
+                        std::back_inserter(scratch.removed));
+
+    // add before removing, so that no region we are still in is
+    // emptied and garbage collected under us
+    FOR_EACH (it, scratch.added)
+      (*it)->AddBlock(this, layer);
+
+    FOR_EACH (it, scratch.removed)
+      (*it)->RemoveBlock(this, layer);
+
+    // AddBlock() appended the added cells unsorted, so take the sorted
+    // list, and leave the old buffers for the next move
+    rendered_cells[layer].swap(scratch.cells);
+    rendered_pts[layer].swap(scratch.pts);
+  }
+
+  UpdateGlobalZ();
+}
+
+void Block::UpdateGlobalZ()
+{
+  // update the block's absolute z bounds at this rendering
+  Pose gpose(group->mod.GetGlobalPose());
+  gpose.z += group->mod.geom.pose.z;
+  global_z.min = Shape().local_z.min + gpose.z;
+  global_z.max = Shape().local_z.max + gpose.z;
 }
 
 void swap(int &a, int &b)
@@ -202,6 +260,7 @@ void Block::Rasterize(uint8_t *data, unsigned int width, unsigned int height, me
   // %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
 
+  const std::vector<point_t> &pts = Shape().pts;
   const size_t pt_count = pts.size();
   for (size_t i = 0; i < pt_count; ++i) {
     // convert points from local to model coords
@@ -271,31 +330,35 @@ void Block::DrawTop()
   // draw the top of the block - a polygon at the highest vertical
   // extent
 
+  const BlockShape &shape = Shape();
+
   glBegin(GL_POLYGON);
-  FOR_EACH (it, pts)
-    glVertex3f(it->x, it->y, local_z.max);
+  FOR_EACH (it, shape.pts)
+    glVertex3f(it->x, it->y, shape.local_z.max);
   glEnd();
 }
 
 void Block::DrawSides()
 {
+  const BlockShape &shape = Shape();
+
   // construct a strip that wraps around the polygon
   glBegin(GL_QUAD_STRIP);
 
-  FOR_EACH (it, pts) {
-    glVertex3f(it->x, it->y, local_z.max);
-    glVertex3f(it->x, it->y, local_z.min);
+  FOR_EACH (it, shape.pts) {
+    glVertex3f(it->x, it->y, shape.local_z.max);
+    glVertex3f(it->x, it->y, shape.local_z.min);
   }
   // close the strip
-  glVertex3f(pts[0].x, pts[0].y, local_z.max);
-  glVertex3f(pts[0].x, pts[0].y, local_z.min);
+  glVertex3f(shape.pts[0].x, shape.pts[0].y, shape.local_z.max);
+  glVertex3f(shape.pts[0].x, shape.pts[0].y, shape.local_z.min);
   glEnd();
 }
 
 void Block::DrawFootPrint()
 {
   glBegin(GL_POLYGON);
-  FOR_EACH (it, pts)
+  FOR_EACH (it, Shape().pts)
     glVertex2f(it->x, it->y);
   glEnd();
 }
@@ -306,7 +369,7 @@ void Block::DrawSolid(bool)
   DrawTop();
 }
 
-void Block::Load(Worldfile *wf, int entity)
+void BlockShape::Load(Worldfile *wf, int entity)
 {
   const size_t pt_count = wf->ReadInt(entity, "points", 0);
 
@@ -6,22 +6,87 @@
 #include <libgen.h> // for dirname(3)
 #include <limits.h> // for _POSIX_PATH_MAX
 #include <limits>
+#include <unistd.h> // for getpid(2)
 
 using namespace Stg;
 using namespace std;
 
-BlockGroup::BlockGroup(Model &mod) : blocks(), displaylist(0), mod(mod)
+BlockGeometry::~BlockGeometry()
+{
+  if (displaylist)
+    glDeleteLists(displaylist, 1);
+}
+
+uint64_t BlockGeometry::Hash() const
+{
+  // FNV-1a over the bytes of the coordinates
+  uint64_t hash = 14695981039346656037ULL;
+
+  FOR_EACH (it, shapes) {
+    const double z[2] = { it->local_z.min, it->local_z.max };
+    const uint8_t *bytes = (const uint8_t *)z;
+    for (size_t i = 0; i < sizeof(z); i++)
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+
+    if (!it->pts.empty()) {
+      bytes = (const uint8_t *)&it->pts[0];
+      for (size_t i = 0; i < it->pts.size() * sizeof(point_t); i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+  }
+
+  return hash;
+}
+
+// drops a reference to geom, deleting it if it was the last
+static void release(BlockGeometry *geom)
+{
+  if (__sync_sub_and_fetch(&geom->refs, 1) == 0)
+    delete geom;
+}
+
+BlockGroup::BlockGroup(Model &mod) : blocks(), geometry(new BlockGeometry), mod(mod)
 { /* empty */
 }
 
 BlockGroup::~BlockGroup()
 {
-  Clear();
+  blocks.clear();
+  release(geometry);
+}
+
+void BlockGroup::AppendBlock(const BlockShape &shape)
+{
+  Unshare();
+  geometry->shapes.push_back(shape);
+  geometry->dirty = true;
+
+  blocks.push_back(Block(this, geometry->shapes.size() - 1));
+}
+
+void BlockGroup::Unshare()
+{
+  if (geometry->refs == 1)
+    return;
+
+  // copy before letting go, so that the last other user can't change
+  // the geometry while it is being copied
+  BlockGeometry *own = new BlockGeometry;
+  own->shapes = geometry->shapes;
+
+  release(geometry);
+  geometry = own;
 }
 
-void BlockGroup::AppendBlock(const Block &block)
+void BlockGroup::Share(BlockGeometry *geom)
 {
-  blocks.push_back(block);
+  if (geom == geometry)
+    return;
+
+  __sync_add_and_fetch(&geom->refs, 1);
+
+  release(geometry);
+  geometry = geom;
 }
 
 void BlockGroup::Clear()
@@ -30,6 +95,14 @@ void BlockGroup::Clear()
   // delete *it;
 
   blocks.clear();
+
+  if (geometry->refs > 1) {
+    release(geometry);
+    geometry = new BlockGeometry;
+  } else {
+    geometry->shapes.clear();
+    geometry->dirty = true;
+  }
 }
 
 void BlockGroup::AppendTouchingModels(std::set<Model *> &v)
@@ -57,7 +130,7 @@ bounds3d_t BlockGroup::BoundingBox() const
   minx = miny = minz = billion;
   maxx = maxy = maxz = -billion;
 
-  FOR_EACH (it, blocks) {
+  FOR_EACH (it, geometry->shapes) {
     // examine all the points in the polygon
     FOR_EACH (pit, it->pts) {
       if (pit->x < minx)
@@ -98,7 +171,11 @@ void BlockGroup::CalcSize()
   // that the original points are now in model coordinates
   const Size modsize = mod.geom.size;
 
-  FOR_EACH (it, blocks) {
+  // the geometry may be shared, so scale a copy and keep it only if
+  // it differs
+  std::vector<BlockShape> shapes(geometry->shapes);
+
+  FOR_EACH (it, shapes) {
     // polygon edges
     FOR_EACH (pit, it->pts) {
       pit->x = (pit->x - offset.x) * (modsize.x / size.x);
@@ -109,6 +186,13 @@ void BlockGroup::CalcSize()
     it->local_z.min = (it->local_z.min - offset.z) * (modsize.z / size.z);
     it->local_z.max = (it->local_z.max - offset.z) * (modsize.z / size.z);
   }
+
+  if (shapes == geometry->shapes)
+    return;
+
+  Unshare();
+  geometry->shapes.swap(shapes);
+  geometry->dirty = true;
 }
 
 void BlockGroup::Map(unsigned int layer)
@@ -120,6 +204,24 @@ void BlockGroup::Map(unsigned int layer)
       it->Map(layer);
 }
 
+void BlockGroup::PrepareMap(std::vector<std::vector<point_int_t> > &pts,
+                            std::vector<std::vector<point_int_t> > &pixels) const
+{
+  pts.resize(blocks.size());
+  pixels.resize(blocks.size());
+
+  for (size_t i = 0; i < blocks.size(); i++)
+    blocks[i].PrepareMap(pts[i], pixels[i]);
+}
+
+void BlockGroup::FinishMap(unsigned int layer,
+                           const std::vector<std::vector<point_int_t> > &pts,
+                           const std::vector<std::vector<Cell *> > &cells)
+{
+  for (size_t i = 0; i < blocks.size(); i++)
+    blocks[i].FinishMap(layer, pts[i], cells[i]);
+}
+
 void BlockGroup::UnMap(unsigned int layer)
 {
   //static size_t count = 0;
@@ -131,6 +233,12 @@ void BlockGroup::UnMap(unsigned int layer)
 
 }
 
+void BlockGroup::ReMap(unsigned int layer)
+{
+  FOR_EACH (it, blocks)
+    it->ReMap(layer);
+}
+
 void BlockGroup::DrawSolid(const Geom &geom)
 {
   glPushMatrix();
@@ -180,13 +288,11 @@ void BlockGroup::BuildDisplayList()
   if (!mod.world->IsGUI())
     return;
 
-  if (displaylist == 0) {
+  if (geometry->displaylist == 0)
     CalcSize(); // todo: is this redundant? count calls per model to figure this
-    // out.
-
-    displaylist = glGenLists(1);
-    assert(displaylist != 0);
+  // out.
 
+  if (tobj == NULL) {
     // Stage polygons need not be convex, so we have to tesselate them for
     // rendering in OpenGL.
     tobj = gluNewTess();
@@ -203,28 +309,26 @@ void BlockGroup::BuildDisplayList()
     gluTessCallback(tobj, GLU_TESS_COMBINE, (GLvoid(*)()) & combineCallback);
   }
 
+  if (geometry->displaylist == 0) {
+    geometry->displaylist = glGenLists(1);
+    assert(geometry->displaylist != 0);
+  }
+
   std::vector<std::vector<GLdouble> > contours;
 
-  FOR_EACH (blk, blocks) {
+  FOR_EACH (shape, geometry->shapes) {
     std::vector<GLdouble> verts;
-    FOR_EACH (it, blk->pts) {
+    FOR_EACH (it, shape->pts) {
       verts.push_back(it->x);
       verts.push_back(it->y);
-      verts.push_back(blk->local_z.max);
+      verts.push_back(shape->local_z.max);
     }
     contours.push_back(verts);
   }
 
-  glNewList(displaylist, GL_COMPILE);
-
-  Gl::pose_shift(mod.GetGeom().pose);
-
-  // draw filled polys
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glEnable(GL_POLYGON_OFFSET_FILL);
-  glPolygonOffset(0.5, 0.5);
-
-  mod.PushColor(mod.color);
+  // the list holds only the shapes, so that every model sharing the
+  // geometry can draw it with its own pose and color
+  glNewList(geometry->displaylist, GL_COMPILE);
 
   gluTessBeginPolygon(tobj, NULL);
 
@@ -240,6 +344,25 @@ void BlockGroup::BuildDisplayList()
   FOR_EACH (blk, blocks)
     blk->DrawSides();
 
+  glEndList();
+
+  geometry->dirty = false;
+}
+
+void BlockGroup::CallDisplayList()
+{
+  if (geometry->displaylist == 0 || geometry->dirty)
+    BuildDisplayList();
+
+  Gl::pose_shift(mod.GetGeom().pose);
+
+  // draw filled polys
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(0.5, 0.5);
+
+  mod.PushColor(mod.color);
+  glCallList(geometry->displaylist);
   mod.PopColor();
 
   // now outline the polys
@@ -252,81 +375,208 @@ void BlockGroup::BuildDisplayList()
   c.g /= 2.0;
   c.b /= 2.0;
   mod.PushColor(c);
+  glCallList(geometry->displaylist);
+  mod.PopColor();
 
-  gluTessBeginPolygon(tobj, NULL);
+  glDepthMask(GL_TRUE);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
 
-  FOR_EACH (contour, contours) {
-    gluTessBeginContour(tobj);
-    for (size_t v = 0; v < contour->size(); v += 3)
-      gluTessVertex(tobj, &(*contour)[v], &(*contour)[v]);
-    gluTessEndContour(tobj);
-  }
+void BlockGroup::LoadBlock(Worldfile *wf, int entity)
+{
+  BlockShape shape;
+  shape.Load(wf, entity);
+  AppendBlock(shape);
+  // CalcSize(); // adjust the blocks so they fit in our bounding box
+}
 
-  gluTessEndPolygon(tobj);
+// the bitmap cache file format: a header, then for each polygon its
+// number of vertices followed by their pixel coordinates. Everything
+// is stored in host byte order.
+static const char BITMAP_CACHE_MAGIC[8] = { 'S', 'T', 'G', 'P', 'O', 'L', 'Y', '1' };
 
-  FOR_EACH (blk, blocks)
-    blk->DrawSides();
+/** Computes the 64-bit FNV-1a hash of the contents of a file. Returns
+    false if the file can't be read. */
+static bool hash_file(const std::string &path, uint64_t &hash)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL)
+    return false;
+
+  hash = 14695981039346656037ULL;
+
+  uint8_t buf[65536];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    for (size_t i = 0; i < len; i++) {
+      hash ^= buf[i];
+      hash *= 1099511628211ULL;
+    }
 
-  glDepthMask(GL_TRUE);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  const bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
 
-  mod.PopColor();
+static bool read_bitmap_cache(const std::string &path, uint64_t hash, uint8_t threshold,
+                              std::vector<std::vector<point_t> > &polys)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL)
+    return false;
+
+  char magic[8];
+  uint64_t fhash = 0;
+  uint8_t fthreshold = 0;
+  uint32_t count = 0;
+
+  bool ok = fread(magic, sizeof(magic), 1, fp) == 1
+            && memcmp(magic, BITMAP_CACHE_MAGIC, sizeof(magic)) == 0
+            && fread(&fhash, sizeof(fhash), 1, fp) == 1 && fhash == hash
+            && fread(&fthreshold, sizeof(fthreshold), 1, fp) == 1 && fthreshold == threshold
+            && fread(&count, sizeof(count), 1, fp) == 1;
+
+  std::vector<int32_t> coords;
+  for (uint32_t p = 0; ok && p < count; p++) {
+    uint32_t len = 0;
+    ok = fread(&len, sizeof(len), 1, fp) == 1;
+
+    coords.resize(2 * len);
+    ok = ok && (len == 0 || fread(&coords[0], sizeof(int32_t), 2 * len, fp) == 2 * len);
+
+    if (ok) {
+      std::vector<point_t> poly(len);
+      for (uint32_t i = 0; i < len; i++)
+        poly[i] = point_t(coords[2 * i], coords[2 * i + 1]);
+      polys.push_back(poly);
+    }
+  }
 
-  glEndList();
+  fclose(fp);
+
+  if (!ok)
+    polys.clear();
+
+  return ok;
 }
 
-void BlockGroup::CallDisplayList()
+static void write_bitmap_cache(const std::string &path, uint64_t hash, uint8_t threshold,
+                               const std::vector<std::vector<point_t> > &polys)
 {
-  if (displaylist == 0 || mod.rebuild_displaylist) {
-    BuildDisplayList();
-    mod.rebuild_displaylist = 0;
+  // many simulations may share a cache, so write a private file and
+  // rename it into place, which is atomic
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+  const std::string tmp = path + suffix;
+
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) {
+    PRINT_WARN1("failed to write bitmap cache \"%s\"", tmp.c_str());
+    return;
   }
 
-  glCallList(displaylist);
+  const uint32_t count = polys.size();
+  bool ok = fwrite(BITMAP_CACHE_MAGIC, sizeof(BITMAP_CACHE_MAGIC), 1, fp) == 1
+            && fwrite(&hash, sizeof(hash), 1, fp) == 1
+            && fwrite(&threshold, sizeof(threshold), 1, fp) == 1
+            && fwrite(&count, sizeof(count), 1, fp) == 1;
+
+  std::vector<int32_t> coords;
+  FOR_EACH (it, polys) {
+    const uint32_t len = it->size();
+    coords.resize(2 * len);
+    for (uint32_t i = 0; i < len; i++) {
+      coords[2 * i] = (int32_t)(*it)[i].x;
+      coords[2 * i + 1] = (int32_t)(*it)[i].y;
+    }
+
+    ok = ok && fwrite(&len, sizeof(len), 1, fp) == 1
+         && (len == 0 || fwrite(&coords[0], sizeof(int32_t), 2 * len, fp) == 2 * len);
+  }
+
+  if (fclose(fp) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    PRINT_WARN1("failed to write bitmap cache \"%s\"", path.c_str());
+    unlink(tmp.c_str());
+  }
 }
 
-void BlockGroup::LoadBlock(Worldfile *wf, int entity)
+void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 {
-  AppendBlock(Block(this, wf, entity));
-  // CalcSize(); // adjust the blocks so they fit in our bounding box
+  std::vector<std::vector<point_t> > polys;
+  bool cached;
+
+  if (VectorizeBitmap(bitmapfile, wf, polys, cached))
+    AppendBitmap(bitmapfile, polys, cached);
 }
 
-void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
+bool BlockGroup::VectorizeBitmap(const std::string &bitmapfile, Worldfile *wf,
+                                 std::vector<std::vector<point_t> > &polys, bool &cached) const
 {
   PRINT_DEBUG1("attempting to load bitmap \"%s\n", bitmapfile.c_str());
 
+  char *workaround_const = strdup(wf->filename.c_str());
+  const std::string worlddir(dirname(workaround_const));
+  free(workaround_const);
+
   std::string full;
 
   if (bitmapfile[0] == '/')
     full = bitmapfile;
-  else {
-    char *workaround_const = strdup(wf->filename.c_str());
-    full = std::string(dirname(workaround_const)) + "/" + bitmapfile;
-    free(workaround_const);
-  }
-
-  char buf[512];
-  snprintf(buf, 512, "[Image \"%s\"", bitmapfile.c_str());
-  fputs(buf, stdout);
-  fflush(stdout);
+  else
+    full = worlddir + "/" + bitmapfile;
 
   PRINT_DEBUG1("attempting to load image %s", full.c_str());
 
-  Color col(1.0, 0.0, 1.0, 1.0);
+  // TODO: make this a parameter
+  const uint8_t threshold = 127;
+
+  polys.clear();
+  cached = false;
+
+  // the cache file is named after the image and the hash of its
+  // contents, so an edited image is never matched with stale polygons
+  std::string cachefile;
+  uint64_t hash = 0;
+  const std::string &cachedir = mod.GetWorld()->BitmapCache();
+
+  if (!cachedir.empty() && hash_file(full, hash)) {
+    char *workaround_const = strdup(bitmapfile.c_str());
+    char name[64];
+    snprintf(name, sizeof(name), "-%016llx-%u.stgpoly", (unsigned long long)hash,
+             (unsigned int)threshold);
+    cachefile = (cachedir[0] == '/' ? cachedir : worlddir + "/" + cachedir) + "/"
+                + basename(workaround_const) + name;
+    free(workaround_const);
+  }
 
-  std::vector<std::vector<point_t> > polys;
+  if (!cachefile.empty() && read_bitmap_cache(cachefile, hash, threshold, polys)) {
+    cached = true;
+  } else {
+    if (polys_from_image_file(full, polys, threshold)) {
+      PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
+      return false;
+    }
 
-  if (polys_from_image_file(full, polys)) {
-    PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
-    return;
+    if (!cachefile.empty())
+      write_bitmap_cache(cachefile, hash, threshold, polys);
   }
 
-  FOR_EACH (it, polys)
-    AppendBlock(Block(this, *it, Bounds(0, 1)));
+  return true;
+}
+
+void BlockGroup::AppendBitmap(const std::string &bitmapfile,
+                              const std::vector<std::vector<point_t> > &polys, bool cached)
+{
+  size_t vertices = 0;
+  FOR_EACH (it, polys) {
+    AppendBlock(BlockShape(*it, Bounds(0, 1)));
+    vertices += it->size();
+  }
 
   CalcSize();
 
-  fputs("]", stdout);
+  printf("[Image \"%s\"%s %lu blocks %lu vertices]", bitmapfile.c_str(), cached ? " cached" : "",
+         (unsigned long)polys.size(), (unsigned long)vertices);
 }
 
 void BlockGroup::Rasterize(uint8_t *data, unsigned int width, unsigned int height,
@@ -951,21 +951,17 @@ void Canvas::renderFrame()
     glPopMatrix();
   }
 
-  if (world->ray_list.size() > 0) {
-    glDisable(GL_DEPTH_TEST);
-    PushColor(0, 0, 0, 0.5);
-    FOR_EACH (it, world->ray_list) {
-      float *pts = *it;
-      glBegin(GL_LINES);
-      glVertex2f(pts[0], pts[1]);
-      glVertex2f(pts[2], pts[3]);
-      glEnd();
+  FOR_EACH (it, world->ray_records)
+    if (it->Count() > 0) {
+      glDisable(GL_DEPTH_TEST);
+      PushColor(0, 0, 0, 0.5);
+      glVertexPointer(2, GL_FLOAT, 0, it->Points());
+      glDrawArrays(GL_LINES, 0, 2 * it->Count());
+      PopColor();
+      glEnable(GL_DEPTH_TEST);
     }
-    PopColor();
-    glEnable(GL_DEPTH_TEST);
 
-    world->ClearRays();
-  }
+  world->ClearRays();
 
   if (showClock) {
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -26,6 +26,17 @@ Color::Color(const std::string &name) : r(1), g(0), b(0), a(1)
   if (name == "") // empty string?
     return; // red
 
+  // a hex triplet, as in "#ff8000"
+  unsigned int hex;
+  int hex_chars = 0;
+  if (name.size() == 7 && sscanf(name.c_str(), "#%6x%n", &hex, &hex_chars) == 1
+      && hex_chars == 7) {
+    r = ((hex >> 16) & 0xff) / 255.0;
+    g = ((hex >> 8) & 0xff) / 255.0;
+    b = (hex & 0xff) / 255.0;
+    return;
+  }
+
   static FILE *file = NULL;
   static std::map<std::string, Color> table;
 
@@ -91,32 +102,42 @@ Color Color::RandomColor()
   return Color(drand48(), drand48(), drand48());
 }
 
+Color Color::RandomColor(RandomStream &rng)
+{
+  const double r(rng.Uniform()), g(rng.Uniform()), b(rng.Uniform());
+  return Color(r, g, b);
+}
+
 void Color::Print(const char *prefix) const
 {
   printf("%s [%.2f %.2f %.2f %.2f]\n", prefix, r, g, b, a);
 }
 
-const Color &Color::Load(Worldfile *wf, const int section)
+// load a color, drawing a "random" one from rng, or from drand48() if
+// rng is NULL
+static void LoadColor(Color &color, Worldfile *wf, const int section, RandomStream *rng)
 {
   if (wf->PropertyExists(section, "color")) {
     const std::string &colorstr = wf->ReadString(section, "color", "");
 
     if (colorstr != "") {
-      if (colorstr == "random") {
-        r = drand48();
-        g = drand48();
-        b = drand48();
-        a = 1.0;
-      } else {
-        Color c = Color(colorstr);
-        r = c.r;
-        g = c.g;
-        b = c.b;
-        a = c.a;
-      }
+      if (colorstr == "random")
+        color = rng ? Color::RandomColor(*rng) : Color::RandomColor();
+      else
+        color = Color(colorstr);
     }
   } else
-    wf->ReadTuple(section, "color_rgba", 0, 4, "ffff", &r, &g, &b, &a);
+    wf->ReadTuple(section, "color_rgba", 0, 4, "ffff", &color.r, &color.g, &color.b, &color.a);
+}
 
+const Color &Color::Load(Worldfile *wf, const int section)
+{
+  LoadColor(*this, wf, section, NULL);
+  return *this;
+}
+
+const Color &Color::Load(Worldfile *wf, const int section, RandomStream &rng)
+{
+  LoadColor(*this, wf, section, &rng);
   return *this;
 }
@@ -19,6 +19,13 @@
 
     -a \"str\"       : equivalent to --args "str"
 
+    --compile      : compile each world file into a binary file that loads
+                     faster, instead of running it. The compiled file is
+                     named after the world file, with extension .stgbin,
+                     and it can be loaded by stage like any world file
+
+    -o \"file\"      : with --compile, the name of the compiled file
+
     -h             : equivalent to --help"
 
     -?             : equivalent to --help
@@ -28,6 +35,7 @@
 
 #include "config.h"
 #include "stage.hh"
+#include "worldfile.hh"
 using namespace Stg;
 
 const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldfileN]\n"
@@ -40,6 +48,9 @@ const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldf
                     "  --args \"str\"   : define an argument string to be passed to all "
                     "controllers\n"
                     "  -a \"str\"       : equivalent to --args \"str\"\n"
+                    "  --compile      : compile each world file into a binary .stgbin file that\n"
+                    "                   loads faster, instead of running it\n"
+                    "  -o \"file\"      : with --compile, the name of the compiled file\n"
                     "  -h             : equivalent to --help\n"
                     "  -?             : equivalent to --help";
 
@@ -50,6 +61,7 @@ static struct option longopts[] = {
   { "clock",  optional_argument,   NULL,  'c' },
   { "help",  optional_argument,   NULL,  'h' },
   { "args",  required_argument,   NULL,  'a' },
+  { "compile",  no_argument,   NULL,  'C' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -63,8 +75,10 @@ int main( int argc, char* argv[] )
   int ch = 0, optindex = 0;
   bool usegui = true;
   bool showclock = false;
+  bool compile = false;
+  std::string output;
 
-  while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1) {
+  while ((ch = getopt_long(argc, argv, "cgh?o:", longopts, &optindex)) != -1) {
     switch (ch) {
     case 0: // long option given
       printf("option %s given\n", longopts[optindex].name);
@@ -78,6 +92,8 @@ int main( int argc, char* argv[] )
       usegui = false;
       printf("[GUI disabled]");
       break;
+    case 'C': compile = true; break;
+    case 'o': output = optarg; break;
     case 'h':
     case '?':
       puts(USAGE);
@@ -99,6 +115,27 @@ int main( int argc, char* argv[] )
   while (optindex < argc) {
     if (optindex > 0) {
       const char *worldfilename = argv[optindex];
+
+      if (compile) {
+        std::string outfile(output);
+        if (outfile.empty()) {
+          outfile = worldfilename;
+          const size_t dot(outfile.find_last_of('.'));
+          if (dot != std::string::npos && outfile.find('/', dot) == std::string::npos)
+            outfile.erase(dot);
+          outfile += ".stgbin";
+        }
+
+        Worldfile wf;
+        if (!wf.Compile(worldfilename, outfile))
+          return EXIT_FAILURE;
+
+        printf("[Compiled %s to %s]\n", worldfilename, outfile.c_str());
+        output.clear(); // -o names only the first compiled file
+        optindex++;
+        continue;
+      }
+
       World *world = (usegui ? new WorldGui(400, 300, worldfilename) : new World(worldfilename));
       world->Load(worldfilename);
       world->ShowClock(showclock);
@@ -109,6 +146,9 @@ int main( int argc, char* argv[] )
     optindex++;
   }
 
+  if (compile)
+    return EXIT_SUCCESS;
+
   World::Run();
 
   puts("\n[Stage: done]");
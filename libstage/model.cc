@@ -69,7 +69,8 @@
     the frequency with which this model's data is generated.
 
     - color <string>\n specify the color of the object using a color
-    name from the X11 database (rgb.txt)
+    name from the X11 database (rgb.txt), or as a hex triplet such as
+    "#ff8000"
 
     - bitmap filename:<string>\n Draw the model by interpreting the
     lines in a bitmap (bmp, jpeg, gif, png supported). The file is
@@ -228,14 +229,16 @@ Model::GuiState &Model::GuiState::Load(Worldfile *wf, int wf_entity)
 
 // constructor
 Model::Model(World *world, Model *parent, const std::string &type, const std::string &name)
-    : Ancestor(), mapped(false), drawOptions(), alwayson(false), blockgroup(*this), boundary(false),
+    : Ancestor(), mapped(false), static_map(false), repositioned(false), drawOptions(), alwayson(false), blockgroup(*this), boundary(false),
       callbacks(__CB_TYPE_COUNT), // one slot in the vector for each type
       color(1, 0, 0), // red
       data_fresh(false), disabled(false), cv_list(), flag_list(), friction(DEFAULT_FRICTION),
-      geom(), has_default_block(true), id(Model::count++), interval((usec_t)1e5), // 100msec
+      geom(), has_default_block(true), id(Model::count++),
+      rng((uint64_t(world->RandomSeed()) << 32) | id), interval((usec_t)1e5), // 100msec
       interval_energy((usec_t)1e5), // 100msec
-      last_update(0), log_state(false), map_resolution(0.1), mass(0), parent(parent), pose(),
-      power_pack(NULL), pps_charging(), rastervis(), rebuild_displaylist(true), say_string(),
+      last_update(0), log_state(false), map_resolution(0.1), mass(0), parent(parent), root(this), tree_pre(0), tree_post(0), pose(),
+      global_pose(), global_cosa(1), global_sina(0), global_origin(), origin_cosa(1),
+      origin_sina(0), power_pack(NULL), pps_charging(), rastervis(), say_string(),
       stack_children(true), stall(false), subs(0), thread_safe(false), trail(20),
       trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false), watts(0.0), watts_give(0.0),
       watts_take(0.0), wf(NULL), wf_entity(0), world(world),
@@ -286,6 +289,11 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
     gui.move = true;
   }
 
+  uint32_t counter(0);
+  (parent ? parent->root : this)->LabelTree(NULL, counter);
+
+  UpdateGlobalPose();
+
   //static size_t count=0;
   //printf( "basic %lu\n", ++count );
 
@@ -375,6 +383,28 @@ void Model::LoadBlock(Worldfile *wf, int entity)
   blockgroup.LoadBlock(wf, entity);
 }
 
+void Model::AddBoundaryBlocks()
+{
+  if (!boundary)
+    return;
+
+  // PRINT_WARN1( "setting boundary for %s\n", token );
+
+  blockgroup.CalcSize();
+
+  const double epsilon = 0.01;
+  const bounds3d_t b = blockgroup.BoundingBox();
+
+  const Size size(b.x.max - b.x.min, b.y.max - b.y.min, b.z.max - b.z.min);
+
+  //static size_t count=0;
+  //printf( "boundaries %lu\n", ++count );
+  AddBlockRect(b.x.min, b.y.min, epsilon, size.y, size.z);
+  AddBlockRect(b.x.min, b.y.min, size.x, epsilon, size.z);
+  AddBlockRect(b.x.min, b.y.max - epsilon, size.x, epsilon, size.z);
+  AddBlockRect(b.x.max - epsilon, b.y.min, epsilon, size.y, size.z);
+}
+
 void Model::AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meters_t dz)
 {
   UnMap();
@@ -389,7 +419,7 @@ void Model::AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meter
   pts[3].x = x;
   pts[3].y = y + dy;
 
-  blockgroup.AppendBlock(Block(&blockgroup, pts, Bounds(0, dz)));
+  blockgroup.AppendBlock(BlockShape(pts, Bounds(0, dz)));
 
   Map();
 }
@@ -398,9 +428,9 @@ void Model::AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meter
 Pose Model::GlobalToLocal(const Pose &pose) const
 {
   // get model's global pose
-  const Pose org(GetGlobalPose());
-  const double cosa(cos(org.a));
-  const double sina(sin(org.a));
+  const Pose &org(global_pose);
+  const double cosa(global_cosa);
+  const double sina(global_sina);
 
   // compute global pose in local coords
   return Pose((pose.x - org.x) * cosa + (pose.y - org.y) * sina,
@@ -412,52 +442,15 @@ void Model::Say(const std::string &str)
   say_string = str;
 }
 
-// returns true iff model [testmod] is an antecedent of this model
-bool Model::IsAntecedent(const Model *testmod) const
+void Model::LabelTree(Model *treeroot, uint32_t &counter)
 {
-  if (parent == NULL)
-    return false;
-
-  if (parent == testmod)
-    return true;
-
-  return parent->IsAntecedent(testmod);
-}
-
-// returns true iff model [testmod] is a descendent of this model
-bool Model::IsDescendent(const Model *testmod) const
-{
-  if (this == testmod)
-    return true;
+  root = treeroot ? treeroot : this;
+  tree_pre = counter++;
 
   FOR_EACH (it, children)
-    if ((*it)->IsDescendent(testmod))
-      return true;
-
-  // neither mod nor a child of this matches testmod
-  return false;
-}
-
-bool Model::IsRelated(const Model *that) const
-{
-  // is it me?
-  if (this == that)
-    return true;
-
-  // wind up to top-level object
-  const Model *candidate = this;
-  while (candidate->parent) {
-    // shortcut out if we found it on the way up the tree
-    if (candidate->parent == that)
-      return true;
-
-    candidate = candidate->parent;
-  }
+    (*it)->LabelTree(root, counter);
 
-  // we got to our root, so recurse down the tree
-  return candidate->IsDescendent(that);
-  // TODO: recursive solution is costing us 3% of all compute time! try an
-  // iterative solution?
+  tree_post = counter - 1;
 }
 
 point_t Model::LocalToGlobal(const point_t &pt) const
@@ -467,22 +460,28 @@ point_t Model::LocalToGlobal(const point_t &pt) const
 }
 
 std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local) const
+{
+  std::vector<point_int_t> global;
+  LocalToPixels(local, global);
+  return global;
+}
+
+void Model::LocalToPixels(const std::vector<point_t> &local,
+                          std::vector<point_int_t> &global) const
 {
   const size_t sz = local.size();
 
-  std::vector<point_int_t> global(sz);
+  global.resize(sz);
 
-  const Pose gpose(GetGlobalPose() + geom.pose);
-  Pose ptpose;
+  const Pose &gpose(global_origin);
 
   for (size_t i = 0; i < sz; i++) {
-    ptpose = gpose + Pose(local[i].x, local[i].y, 0, 0);
+    const double x(gpose.x + local[i].x * origin_cosa - local[i].y * origin_sina);
+    const double y(gpose.y + local[i].x * origin_sina + local[i].y * origin_cosa);
 
-    global[i].x = (int32_t)floor(ptpose.x * world->ppm);
-    global[i].y = (int32_t)floor(ptpose.y * world->ppm);
+    global[i].x = (int32_t)floor(x * world->ppm);
+    global[i].y = (int32_t)floor(y * world->ppm);
   }
-
-  return global;
 }
 
 void Model::MapWithChildren(unsigned int layer)
@@ -508,6 +507,15 @@ void Model::UnMapWithChildren(unsigned int layer)
     (*it)->UnMapWithChildren(layer);
 }
 
+void Model::ReMapWithChildren(unsigned int layer)
+{
+  ReMap(layer);
+
+  // recursive call for all the model's children
+  FOR_EACH (it, children)
+    (*it)->ReMapWithChildren(layer);
+}
+
 void Model::UnMapFromRoot(unsigned int layer)
 {
   Root()->UnMapWithChildren(layer);
@@ -603,10 +611,11 @@ void Model::Update(void)
   // callback called in series back in the main thread. It's
   // not safe to run user callbacks in a worker thread, as
   // they may make OpenGL calls or unsafe Stage API calls,
-  // etc. We queue up the callback into a queue specific to
+  // etc. We queue up the callback into a queue specific to the
+  // thread running this update.
 
   if (!callbacks[Model::CB_UPDATE].empty())
-    world->pending_update_callbacks[event_queue_num].push(this);
+    world->pending_update_callbacks[World::CurrentThread()].push(this);
 }
 
 void Model::CallUpdateCallbacks(void)
@@ -645,11 +654,11 @@ bool Model::RandomPoseInFreeSpace(meters_t xmin, meters_t xmax,
 				  meters_t ymin, meters_t ymax,
                                   size_t max_iter)
 {
-  SetPose(Pose::Random(xmin, xmax, ymin, ymax));
+  SetPose(Pose::Random(xmin, xmax, ymin, ymax, rng));
 
   size_t i = 0;
   while (TestCollision() && (max_iter <= 0 || i++ < max_iter))
-    SetPose(Pose::Random(xmin, xmax, ymin, ymax));
+    SetPose(Pose::Random(xmin, xmax, ymin, ymax, rng));
   return i <= max_iter; // return true if a free pose was found within max iterations
 }
 
@@ -754,8 +763,6 @@ Model *Model::GetUnsubscribedModelOfType(const std::string &type) const
 
 void Model::NeedRedraw(void)
 {
-  rebuild_displaylist = true;
-
   if (parent)
     parent->NeedRedraw();
   else
@@ -808,26 +815,107 @@ kg_t Model::GetMassOfChildren() const
 // render all blocks in the group at my global pose and size
 void Model::Map(unsigned int layer)
 {
-  blockgroup.Map(layer);
+  // stationary models live in the static layer. Callers always map
+  // both layers in turn, so only the first call does the work.
+  if (static_map) {
+    if (layer == 0)
+      blockgroup.Map(STATIC_LAYER);
+  } else
+    blockgroup.Map(layer);
 }
 
 void Model::UnMap(unsigned int layer)
 {
-  blockgroup.UnMap(layer);
+  if (static_map) {
+    if (layer == 0)
+      blockgroup.UnMap(STATIC_LAYER);
+  } else
+    blockgroup.UnMap(layer);
 }
 
-void Model::BecomeParentOf(Model *child)
+void Model::PrepareMap(std::vector<std::vector<point_int_t> > &pts,
+                       std::vector<std::vector<point_int_t> > &pixels) const
 {
-  if (child->parent)
-    child->parent->RemoveChild(child);
-  else
-    world->RemoveChild(child);
+  blockgroup.PrepareMap(pts, pixels);
+}
 
-  child->parent = this;
+void Model::FinishMap(const std::vector<std::vector<point_int_t> > &pts,
+                      const std::vector<std::vector<Cell *> > &cells)
+{
+  unsigned int layers[2];
+  const unsigned int count(MapLayers(layers));
+  for (unsigned int l = 0; l < count; ++l)
+    blockgroup.FinishMap(layers[l], pts, cells);
+}
 
-  this->AddChild(child);
+unsigned int Model::MapLayers(unsigned int layers[2]) const
+{
+  if (static_map) {
+    layers[0] = STATIC_LAYER;
+    return 1;
+  }
 
-  world->dirty = true;
+  layers[0] = 0;
+  layers[1] = 1;
+  return 2;
+}
+
+void Model::ReMap(unsigned int layer)
+{
+  if (static_map) {
+    if (layer == 0)
+      blockgroup.ReMap(STATIC_LAYER);
+  } else
+    blockgroup.ReMap(layer);
+}
+
+void Model::SweptExtent(unsigned int layer, const point_t &centre, meters_t dxy, radians_t da,
+                        Bounds &x, Bounds &y) const
+{
+  // the cells we are rendered into now
+  const unsigned int l(static_map ? STATIC_LAYER : layer);
+  FOR_EACH (it, blockgroup.blocks)
+    FOR_EACH (pit, it->rendered_pts[l]) {
+      x.min = std::min(x.min, pit->x / world->ppm);
+      x.max = std::max(x.max, (pit->x + 1) / world->ppm);
+      y.min = std::min(y.min, pit->y / world->ppm);
+      y.max = std::max(y.max, (pit->y + 1) / world->ppm);
+    }
+
+  // our blocks are scaled to fit our geom, so wherever the move
+  // takes us they lie within this circle about our origin
+  const meters_t radius(hypot(geom.size.x, geom.size.y) / 2.0 + dxy
+                        + da * hypot(global_origin.x - centre.x, global_origin.y - centre.y));
+  x.min = std::min(x.min, global_origin.x - radius);
+  x.max = std::max(x.max, global_origin.x + radius);
+  y.min = std::min(y.min, global_origin.y - radius);
+  y.max = std::max(y.max, global_origin.y + radius);
+
+  FOR_EACH (it, children)
+    (*it)->SweptExtent(layer, centre, dxy, da, x, y);
+}
+
+bool Model::Stationary() const
+{
+  // these models move themselves (or their descendents) one layer at
+  // a time, and anything moved by SetPose() may move again
+  if (repositioned || type == "position" || type == "gripper" || type == "actuator")
+    return false;
+
+  return parent ? parent->Stationary() : true;
+}
+
+void Model::SetStaticMapWithChildren()
+{
+  static_map = Stationary();
+
+  FOR_EACH (it, children)
+    (*it)->SetStaticMapWithChildren();
+}
+
+void Model::BecomeParentOf(Model *child)
+{
+  child->Reparent(this);
 }
 
 PowerPack *Model::FindPowerPack() const
@@ -1064,6 +1152,7 @@ void Model::SetGeom(const Geom &val)
   UnMapWithChildren(1);
 
   geom = val;
+  UpdateGlobalPose();
 
   blockgroup.CalcSize();
 
@@ -1172,11 +1261,14 @@ void Model::SetGlobalPose(const Pose &gpose)
   SetPose(parent ? parent->GlobalToLocal(gpose) : gpose);
 }
 
-int Model::SetParent(Model *newparent)
+void Model::Reparent(Model *newparent)
 {
-  Pose oldPose = GetGlobalPose();
+  // the new parent may move, or stop moving, so we might change layers
+  UnMapWithChildren(0);
+  UnMapWithChildren(1);
 
   // remove the model from its old parent (if it has one)
+  Model *oldroot(root);
   if (parent)
     parent->RemoveChild(this);
   else
@@ -1189,8 +1281,29 @@ int Model::SetParent(Model *newparent)
   else
     world->AddModel(this);
 
+  // both trees have changed shape
+  uint32_t counter(0);
+  if (oldroot != this)
+    oldroot->LabelTree(NULL, counter);
+  counter = 0;
+  (newparent ? newparent->root : this)->LabelTree(NULL, counter);
+
   CallCallbacks(CB_PARENT);
 
+  UpdateGlobalPose();
+  SetStaticMapWithChildren();
+  MapWithChildren(0);
+  MapWithChildren(1);
+
+  world->dirty = true;
+}
+
+int Model::SetParent(Model *newparent)
+{
+  Pose oldPose = GetGlobalPose();
+
+  Reparent(newparent);
+
   SetGlobalPose(oldPose); // Needs to recalculate position due to change in parent
 
   return 0; // ok
@@ -1198,18 +1311,39 @@ int Model::SetParent(Model *newparent)
 
 // get the model's position in the global frame
 Pose Model::GetGlobalPose() const
+{
+  return global_pose;
+}
+
+void Model::UpdateGlobalPose()
 {
   // if I'm a top level model, my global pose is my local pose
   if (parent == NULL)
-    return pose;
+    global_pose = pose;
+  else {
+    // otherwise, compose with our parent's global pose, reusing its trig
+    const Pose &pg(parent->global_pose);
+    global_pose = Pose(pg.x + pose.x * parent->global_cosa - pose.y * parent->global_sina,
+                       pg.y + pose.x * parent->global_sina + pose.y * parent->global_cosa,
+                       pg.z + pose.z, normalize(pg.a + pose.a));
+
+    if (parent->stack_children) // should we be on top of our parent?
+      global_pose.z += parent->geom.size.z;
+  }
 
-  // otherwise
-  Pose global_pose = parent->GetGlobalPose() + pose;
+  global_cosa = cos(global_pose.a);
+  global_sina = sin(global_pose.a);
 
-  if (parent->stack_children) // should we be on top of our parent?
-    global_pose.z += parent->geom.size.z;
+  global_origin = global_pose + geom.pose;
+  origin_cosa = cos(global_origin.a);
+  origin_sina = sin(global_origin.a);
 
-  return global_pose;
+  if (vis.fiducial_return)
+    world->FiducialMoved(this);
+
+  // our children are placed relative to us
+  FOR_EACH (it, children)
+    (*it)->UpdateGlobalPose();
 }
 
 // set the model's pose in the local frame
@@ -1219,6 +1353,7 @@ void Model::SetPose(const Pose &newpose)
   if (pose != newpose) {
     pose = newpose;
     pose.a = normalize(pose.a);
+    UpdateGlobalPose();
 
     //       if( isnan( pose.a ) )
     // 		  printf( "SetPose bad angle %s [%.2f %.2f %.2f %.2f]\n",
@@ -1230,6 +1365,13 @@ void Model::SetPose(const Pose &newpose)
     UnMapWithChildren(0);
     UnMapWithChildren(1);
 
+    // the static layer has no second buffer for sensors to read while
+    // it changes, so a model that turns out to move leaves it for good
+    if (static_map) {
+      repositioned = true;
+      SetStaticMapWithChildren();
+    }
+
     MapWithChildren(0);
     MapWithChildren(1);
 
@@ -1318,14 +1460,14 @@ void Model::Load()
     const std::string &colorstr = wf->ReadString(wf_entity, "color", "");
     if (colorstr != "") {
       if (colorstr == "random")
-        col = Color(drand48(), drand48(), drand48());
+        col = Color::RandomColor(rng);
       else
         col = Color(colorstr);
     }
     this->SetColor(col);
   }
 
-  this->SetColor(GetColor().Load(wf, wf_entity));
+  this->SetColor(GetColor().Load(wf, wf_entity, rng));
 
   if (wf->ReadInt(wf_entity, "noblocks", 0)) {
     if (has_default_block) {
@@ -1345,32 +1487,23 @@ void Model::Load()
       has_default_block = false;
     }
 
-    blockgroup.LoadBitmap(bitmapfile, wf);
+    // while the world is loading it vectorizes all the bitmaps at
+    // once, and adds the blocks and any boundary once it has
+    if (world->loading)
+      blockgroup.pending_bitmap = bitmapfile;
+    else
+      blockgroup.LoadBitmap(bitmapfile, wf);
   }
 
   if (wf->PropertyExists(wf_entity, "boundary")) {
     this->SetBoundary(wf->ReadInt(wf_entity, "boundary", this->boundary));
 
-    if (boundary) {
-      // PRINT_WARN1( "setting boundary for %s\n", token );
-
-      blockgroup.CalcSize();
-
-      const double epsilon = 0.01;
-      const bounds3d_t b = blockgroup.BoundingBox();
-
-      const Size size(b.x.max - b.x.min, b.y.max - b.y.min, b.z.max - b.z.min);
-
-      //static size_t count=0;
-      //printf( "boundaries %lu\n", ++count );
-      AddBlockRect(b.x.min, b.y.min, epsilon, size.y, size.z);
-      AddBlockRect(b.x.min, b.y.min, size.x, epsilon, size.z);
-      AddBlockRect(b.x.min, b.y.max - epsilon, size.x, epsilon, size.z);
-      AddBlockRect(b.x.max - epsilon, b.y.min, epsilon, size.y, size.z);
-    }
+    if (blockgroup.pending_bitmap.empty())
+      AddBoundaryBlocks();
   }
 
   this->stack_children = wf->ReadInt(wf_entity, "stack_children", this->stack_children);
+  UpdateGlobalPose(); // our children may have moved
 
   kg_t m = wf->ReadFloat(wf_entity, "mass", this->mass);
   if (m != this->mass)
@@ -1391,12 +1524,12 @@ void Model::Load()
 
   if (CProperty *ctrlp = wf->GetProperty(wf_entity, "ctrl")) {
     for (unsigned int index = 0; index < ctrlp->values.size(); index++) {
-      const char *lib = wf->GetPropertyValue(ctrlp, index);
+      const std::string lib = wf->GetPropertyValue(ctrlp, index);
 
-      if (!lib)
+      if (lib.empty())
         printf("Error - NULL library name specified for model %s\n", Token());
       else
-        LoadControllerModule(lib);
+        LoadControllerModule(lib.c_str());
     }
   }
 
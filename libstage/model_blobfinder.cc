@@ -99,13 +99,6 @@ ModelBlobfinder::~ModelBlobfinder(void)
 {
 }
 
-static bool blob_match(Model *candidate, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
-
-  return (!finder->IsRelated(candidate));
-}
-
 static bool ColorMatchIgnoreAlpha(Color a, Color b)
 {
   double epsilon = 1e-5; // small
@@ -167,7 +160,7 @@ void ModelBlobfinder::Update(void)
   // generate a scan for post-processing into a blob image
   std::vector<RaytraceResult> samples(scan_width);
 
-  Raytrace(Pose(0, 0, 0, pan), range, fov, blob_match, NULL, false, samples);
+  Raytrace(Pose(0, 0, 0, pan), range, fov, RayMatchUnrelated(), false, samples);
 
   // now the colors and ranges are filled in - time to do blob detection
   double yRadsPerPixel = fov / scan_height;
@@ -154,13 +154,6 @@ void ModelBumper::Load(void)
   }
 }
 
-static bool bumper_match(Model *candidate, const Model *finder, const void *)
-{
-  // Ignore myself, my children, and my ancestors.
-  return ( // candidate->vis.obstacle_return &&
-      !finder->IsRelated(candidate));
-}
-
 void ModelBumper::Update(void)
 {
   Model::Update();
@@ -183,7 +176,8 @@ void ModelBumper::Update(void)
     bpose.x = bumpers[t].pose.x - bumpers[t].length / 2.0 * cos(bpose.a);
     bpose.y = bumpers[t].pose.y - bumpers[t].length / 2.0 * sin(bpose.a);
 
-    RaytraceResult ray = Raytrace(bpose, bumpers[t].length, bumper_match, NULL, false);
+    // Ignore myself, my children, and my ancestors.
+    RaytraceResult ray = Raytrace(bpose, bumpers[t].length, RayMatchUnrelated(), false);
 
     samples[t].hit = ray.mod;
     if (ray.mod) {
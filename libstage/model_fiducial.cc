@@ -100,12 +100,6 @@ ModelFiducial::~ModelFiducial(void)
 {
 }
 
-static bool fiducial_raytrace_match(Model *candidate, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
-  return (!finder->IsRelated(candidate));
-}
-
 void ModelFiducial::AddModelIfVisible(Model *him)
 {
   // PRINT_DEBUG2( "Fiducial %s is testing model %s", token, him->Token() );
@@ -161,9 +155,9 @@ void ModelFiducial::AddModelIfVisible(Model *him)
   // 2. The fiducial is in range of the finder.
   // At this point the purpose of the ray trace is to start at the finder and
   // see if there is anything
-  // in between the finder and the fiducial.  If we simply trace out to the
-  // distance we know the finder
-  // is at, then the resulting ray.mod can be one of three things:
+  // in between the finder and the fiducial.  We trace only out to the far
+  // side of the fiducial model (its origin need not be inside its blocks),
+  // so the resulting hit can be one of three things:
   // 1. A pointer to the model we're tracing to.  In this case the model is at
   // the right Zloc to be
   //    returned by the ray tracer.
@@ -176,28 +170,33 @@ void ModelFiducial::AddModelIfVisible(Model *him)
 
   // printf( "range %.2f\n", range );
 
-  RaytraceResult result = Raytrace(Pose(0, 0, 0, dtheta),
-                                   max_range_anon, // TODOscan only as far as the object
-                                   fiducial_raytrace_match, NULL, true);
+  // no part of him is further from his origin than this
+  const Geom hisgeom(him->GetGeom());
+  const meters_t hisradius(hypot(hisgeom.pose.x, hisgeom.pose.y)
+                           + hypot(hisgeom.size.x, hisgeom.size.y) / 2.0);
+  const meters_t reach(std::min(range + hisradius, max_range_anon));
 
-  // TODO
-  if (ignore_zloc && result.mod == NULL) // i.e. we didn't hit anything *else*
-    result.mod = him; // so he was just at the wrong height
+  const Pose origin(LocalToGlobal(Pose(0, 0, 0, dtheta)));
+  Model *hit(world->LineOfSight(origin,
+                                point_t(origin.x + reach * cos(bearing),
+                                        origin.y + reach * sin(bearing)),
+                                RayMatchUnrelated(), this, true));
+
+  if (ignore_zloc && hit == NULL) // i.e. we didn't hit anything *else*
+    hit = him; // so he was just at the wrong height
 
   // printf( "ray hit %s and was seeking LOS to %s\n",
-  //			ray.mod ? ray.mod->Token() : "null",
+  //			hit ? hit->Token() : "null",
   //			him->Token() );
 
   // if it was him, we can see him
-  if (result.mod != him)
+  if (hit != him)
     return;
 
   assert(range >= 0);
 
   // passed all the tests! record the fiducial hit
 
-  Geom hisgeom(him->GetGeom());
-
   // record where we saw him and what he looked like
   Fiducial fid;
   fid.mod = him;
@@ -236,58 +235,17 @@ void ModelFiducial::Update(void)
   // reset the array of detected fiducials
   fiducials.clear();
 
-#if (1)
-  // BEGIN EXPERIMENT
-
-  // find two sets of fiducial-bearing models, within sensor range on
-  // the two different axes
-
-  double rng = max_range_anon;
-  Pose gp = GetGlobalPose();
-  Model edge; // dummy model used to find bounds in the sets
-
-  edge.pose = Pose(gp.x - rng, gp.y, 0, 0); // LEFT
-  std::set<Model *, World::ltx>::iterator xmin =
-      world->models_with_fiducials_byx.lower_bound(&edge); // O(log(n))
-
-  edge.pose = Pose(gp.x + rng, gp.y, 0, 0); // RIGHT
-  const std::set<Model *, World::ltx>::iterator xmax =
-      world->models_with_fiducials_byx.upper_bound(&edge);
-
-  edge.pose = Pose(gp.x, gp.y - rng, 0, 0); // BOTTOM
-  std::set<Model *, World::lty>::iterator ymin =
-      world->models_with_fiducials_byy.lower_bound(&edge);
-
-  edge.pose = Pose(gp.x, gp.y + rng, 0, 0); // TOP
-  const std::set<Model *, World::lty>::iterator ymax =
-      world->models_with_fiducials_byy.upper_bound(&edge);
-
-  // put these models into sets keyed on model pointer, rather than position
-  std::set<Model *> horiz, vert;
-
-  for (; xmin != xmax; ++xmin)
-    horiz.insert(*xmin);
-
-  for (; ymin != ymax; ++ymin)
-    vert.insert(*ymin);
-
-  // the intersection of the sets is all the fiducials close by
+  // find the fiducial-bearing models within sensor range
+  const Pose &gp(GetGlobalPose());
   std::vector<Model *> nearby;
-  std::set_intersection(horiz.begin(), horiz.end(), vert.begin(), vert.end(),
-                        std::inserter(nearby, nearby.end()));
+  world->fiducial_index.Query(point_t(gp.x, gp.y), max_range_anon, nearby);
 
-  //	printf( "cand sz %lu\n", nearby.size() );
+  // the index returns them in an order that depends on how the models
+  // moved, which varies with the number of threads
+  std::sort(nearby.begin(), nearby.end(), Model::IdLess);
 
-  // create sets sorted by x and y position
   FOR_EACH (it, nearby)
     AddModelIfVisible(*it);
-#else
-  FOR_EACH (it, world->models_with_fiducials)
-    AddModelIfVisible(*it);
-
-#endif
-
-  // find the range of fiducials within range in X
 
   Model::Update();
 }
@@ -326,15 +326,6 @@ void ModelGripper::Update()
   Model::Update();
 }
 
-static bool gripper_raytrace_match(Model *hit, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
-
-  return ((hit != finder) && hit->vis.gripper_return);
-  // can't use the normal relation check, because we may pick things
-  // up and we must still see them.
-}
-
 void ModelGripper::UpdateBreakBeams()
 {
   for (unsigned int index = 0; index < 2; index++) {
@@ -358,7 +349,7 @@ void ModelGripper::UpdateBreakBeams()
         (1.0 - cfg.paddle_position) * (geom.size.y - (geom.size.y * cfg.paddle_size.y * 2.0));
 
     // store the model (possibly NULL) hit by the breakbeam
-    cfg.beam[index] = Raytrace(pz, bbr, gripper_raytrace_match, NULL, true).mod;
+    cfg.beam[index] = Raytrace(pz, bbr, RayMatchGripper(), true).mod;
   }
 
   // autosnatch grabs anything that breaks the inner beam
@@ -400,8 +391,8 @@ void ModelGripper::UpdateContacts()
   // paddle beam max range
   double bbr = cfg.paddle_size.x * geom.size.x;
 
-  cfg.contact[0] = Raytrace(lpz, bbr, gripper_raytrace_match, NULL, true).mod;
-  cfg.contact[1] = Raytrace(rpz, bbr, gripper_raytrace_match, NULL, true).mod;
+  cfg.contact[0] = Raytrace(lpz, bbr, RayMatchGripper(), true).mod;
+  cfg.contact[1] = Raytrace(rpz, bbr, RayMatchGripper(), true).mod;
 
   if (cfg.contact[0] || cfg.contact[1]) {
     cfg.paddles_stalled = true;
@@ -115,10 +115,10 @@ ModelPosition::ModelPosition(World *world, Model *parent, const std::string &typ
       // private
       velocity(), goal(0, 0, 0, 0), control_mode(CONTROL_VELOCITY), drive_mode(DRIVE_DIFFERENTIAL),
       localization_mode(LOCALIZATION_GPS),
-      integration_error(drand48() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A / 2.0),
+      integration_error(Random().Uniform() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X / 2.0,
+                        Random().Uniform() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y / 2.0,
+                        Random().Uniform() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z / 2.0,
+                        Random().Uniform() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A / 2.0),
       wheelbase(1.0), acceleration_bounds(), velocity_bounds(),
       // public
       waypoints(), wpvis(), posevis()
@@ -545,19 +545,21 @@ void ModelPosition::Move(void)
   const Pose startpose(pose);
 
   pose = newpose; // do the move provisionally - we might undo it below
+  UpdateGlobalPose();
 
   const unsigned int layer(world->UpdateCount() % 2);
-  // @todo th
-  UnMapWithChildren(layer); // remove from all blocks
-  MapWithChildren(layer); // render into new blocks
+
+  // move our blocks into their new cells, touching only the cells
+  // that change
+  ReMapWithChildren(layer);
 
   if (TestCollision()) // crunch!
   {
     // put things back the way they were
     // this is expensive, but it happens _very_ rarely for most people
     pose = startpose;
-    UnMapWithChildren(layer);
-    MapWithChildren(layer);
+    UpdateGlobalPose();
+    ReMapWithChildren(layer);
 
     SetStall(true);
   } else {
@@ -565,6 +567,22 @@ void ModelPosition::Move(void)
   }
 }
 
+bool ModelPosition::MoveExtent(unsigned int layer, Bounds &x, Bounds &y) const
+{
+  if (velocity.IsZero() || disabled)
+    return false;
+
+  const double interval((double)world->sim_interval / 1e6);
+  const meters_t dxy(hypot(velocity.x, velocity.y) * interval);
+  const radians_t da(fabs(velocity.a * interval));
+
+  const Pose &gpose(GetGlobalPose());
+  x = Bounds(gpose.x, gpose.x);
+  y = Bounds(gpose.y, gpose.y);
+  SweptExtent(layer, point_t(gpose.x, gpose.y), dxy, da, x, y);
+  return true;
+}
+
 void ModelPosition::Startup(void)
 {
   world->active_velocity.insert(this);
@@ -155,50 +155,6 @@ void ModelRanger::Sensor::Load(Worldfile *wf, int entity)
   color.Load(wf, entity);
 }
 
-static bool ranger_match(Model *hit, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
-
-  // Ignore the model that's looking and things that are invisible to
-  // rangers
-
-  // small optimization to avoid recursive Model::IsRelated call in common cases
-  if ((hit == finder->Parent()) || (hit == finder))
-    return false;
-
-  return ((!hit->IsRelated(finder)) && (sgn(hit->vis.ranger_return) != -1));
-}
-
-// Returns random numbers in range [-1.0, 1.0)
-double simpleNoise()
-{
-  return 2 * (rand() % 1000 * 0.001 - 0.5);
-}
-
-#define TWO_PI (M_PI + M_PI)
-// Returns gaussian noise
-// taken from http://en.wikipedia.org/wiki/Box%E2%80%93Muller_transform
-template <class Scalar_t> Scalar_t generateGaussianNoise(Scalar_t variance)
-{
-  static bool haveSpare = false;
-  static Scalar_t rand1, rand2;
-
-  if (haveSpare) {
-    haveSpare = false;
-    return sqrt(variance * rand1) * sin(rand2);
-  }
-
-  haveSpare = true;
-
-  rand1 = rand() / ((Scalar_t)RAND_MAX);
-  if (rand1 < 1e-100)
-    rand1 = 1e-100;
-  rand1 = -2 * log(rand1);
-  rand2 = (rand() / ((Scalar_t)RAND_MAX)) * TWO_PI;
-
-  return sqrt(variance * rand1) * cos(rand2);
-}
-
 void ModelRanger::Update(void)
 {
   // raytrace new range data for all sensors
@@ -230,29 +186,52 @@ void ModelRanger::Sensor::Update(ModelRanger *mod)
   rayorg = mod->LocalToGlobal(rayorg);
 
   // set up a ray to trace
-  Ray ray(mod, rayorg, range.max, ranger_match, NULL, true);
+  Ray ray(mod, rayorg, range.max, NULL, NULL, true);
 
-  // trace the ray, incrementing its heading for each sample
+  // the noise for the whole scan is drawn in batches, and only if
+  // it's enabled. Uniform noise is in [-1,1).
+  uniform_noise.resize(sample_count);
+  gaussian_noise.resize(sample_count);
+
+  // find the heading of each ray, then trace them all as a fan
+  headings.resize(sample_count);
   for (size_t t(0); t < sample_count; t++) {
-    float savedAngle = ray.origin.a;
-    float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise() * 0.5;
-    ray.origin.a = distortedAngle;
-    const RaytraceResult res = mod->world->Raytrace(ray);
-    ray.origin.a = savedAngle;
-
-    /// Apply noise only if it is in valid range
-    if (res.range < this->range.max)
-      ranges[t] = res.range + res.range * range_noise * simpleNoise()
-                  + generateGaussianNoise(range_noise_const);
-    else
-      ranges[t] = res.range;
-
-    intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
-    bearings[t] = start_angle + ((double)t) * sample_incr;
+    headings[t] = ray.origin.a;
 
     // point the ray to the next angle:
     ray.origin.a += sample_incr;
   }
+
+  if (angle_noise != 0.0) {
+    mod->Random().Uniform(&uniform_noise[0], sample_count);
+    const double scale(sample_incr * angle_noise * 0.5);
+    for (size_t t(0); t < sample_count; t++)
+      headings[t] += scale * (2.0 * uniform_noise[t] - 1.0);
+  }
+
+  mod->world->RaytraceFan(ray, headings, samples, RayMatchRanger());
+
+  for (size_t t(0); t < sample_count; t++) {
+    ranges[t] = samples[t].range;
+    intensities[t] = samples[t].mod ? samples[t].mod->vis.ranger_return : 0.0;
+    bearings[t] = start_angle + ((double)t) * sample_incr;
+  }
+
+  /// Apply noise only to readings in valid range
+  if (range_noise != 0.0) {
+    mod->Random().Uniform(&uniform_noise[0], sample_count);
+    for (size_t t(0); t < sample_count; t++)
+      if (ranges[t] < range.max)
+        ranges[t] += ranges[t] * range_noise * (2.0 * uniform_noise[t] - 1.0);
+  }
+
+  if (range_noise_const != 0.0) {
+    mod->Random().Gaussian(&gaussian_noise[0], sample_count);
+    const double stddev(sqrt(range_noise_const));
+    for (size_t t(0); t < sample_count; t++)
+      if (samples[t].range < range.max)
+        ranges[t] += stddev * gaussian_noise[t];
+  }
 }
 
 std::string ModelRanger::Sensor::String() const
@@ -10,6 +10,8 @@ using namespace Stg;
 
 Stg::Region::Region() : cells(), count(0), superregion(NULL)
 {
+  memset(occupied, 0, sizeof(occupied));
+  memset(occupied_count, 0, sizeof(occupied_count));
 }
 
 Stg::Region::~Region()
@@ -33,8 +35,112 @@ void Stg::Region::RemoveBlock()
     cells.clear();
 }
 
+BlockArena::BlockArena() : slabs(), next(NULL), remaining(0), bytes(0), mutex()
+{
+  memset(free_lists, 0, sizeof(free_lists));
+  pthread_mutex_init(&mutex, NULL);
+}
+
+BlockArena::~BlockArena()
+{
+  FOR_EACH (it, slabs)
+    delete[] * it;
+  pthread_mutex_destroy(&mutex);
+}
+
+Block **BlockArena::Alloc(uint32_t cap)
+{
+  assert(cap && (cap & (cap - 1)) == 0); // power of two
+
+  uint32_t c(0);
+  while ((1u << c) < cap)
+    ++c;
+
+  pthread_mutex_lock(&mutex);
+
+  Block **array(free_lists[c]);
+  if (array) // reuse a freed array if we can
+    free_lists[c] = reinterpret_cast<Block **>(array[0]);
+  else if (cap > SLABSIZE) // huge arrays get a slab of their own
+  {
+    array = new Block *[cap];
+    slabs.push_back(array);
+    bytes += cap * sizeof(Block *);
+  } else {
+    if (remaining < cap) {
+      // the tail of the old slab is abandoned, but slabs are large
+      // compared to arrays, so little is lost
+      next = new Block *[SLABSIZE];
+      slabs.push_back(next);
+      remaining = SLABSIZE;
+      bytes += SLABSIZE * sizeof(Block *);
+    }
+
+    array = next;
+    next += cap;
+    remaining -= cap;
+  }
+
+  pthread_mutex_unlock(&mutex);
+  return array;
+}
+
+void BlockArena::Free(Block **array, uint32_t cap)
+{
+  uint32_t c(0);
+  while ((1u << c) < cap)
+    ++c;
+
+  pthread_mutex_lock(&mutex);
+  array[0] = reinterpret_cast<Block *>(free_lists[c]);
+  free_lists[c] = array;
+  pthread_mutex_unlock(&mutex);
+}
+
+void CellBlocks::push_back(Block *b, BlockArena &arena)
+{
+  if (len == cap) // full, so move to an array twice the size
+  {
+    Block **array(arena.Alloc(cap * 2));
+    memcpy(array, Data(), len * sizeof(Block *));
+
+    if (cap > INLINE)
+      arena.Free(data.arena, cap);
+
+    data.arena = array;
+    cap *= 2;
+  }
+
+  Data()[len++] = b;
+}
+
+void CellBlocks::remove(Block *b, BlockArena &arena)
+{
+  // O(n) * low constant array element removal
+  Block **start(Data());
+  Block **r(start); // read from here
+  Block **w(start); // write to here
+
+  while (r < start + len) // scan down array, skipping b
+  {
+    if (*r != b)
+      *w++ = *r;
+    ++r;
+  }
+  len = w - start;
+
+  // move back inline once we are small enough, so that empty cells
+  // never hold arena memory
+  if (cap > INLINE && len <= INLINE) {
+    Block **array(data.arena);
+    memcpy(data.local, array, len * sizeof(Block *));
+    arena.Free(array, cap);
+    cap = INLINE;
+  }
+}
+
 SuperRegion::SuperRegion(World *world, point_int_t origin)
-    : count(0), origin(origin), regions(), world(world)
+    : count(0), origin(origin), regions(), world(world), arena()
 {
   for (int32_t c = 0; c < SUPERREGIONSIZE; ++c)
     regions[c].superregion = this;
@@ -44,14 +150,26 @@ SuperRegion::~SuperRegion()
 {
 }
 
+// robots in different regions of a superregion may be moved in
+// parallel, so the count is updated atomically
 void SuperRegion::AddBlock()
 {
-  ++count;
+  __sync_fetch_and_add(&count, 1);
 }
 
 void SuperRegion::RemoveBlock()
 {
-  --count;
+  __sync_fetch_and_sub(&count, 1);
+}
+
+size_t SuperRegion::MemoryUsage() const
+{
+  size_t bytes(sizeof(*this) + arena.Bytes());
+
+  for (int32_t r = 0; r < SUPERREGIONSIZE; ++r)
+    bytes += regions[r].cells.capacity() * sizeof(Cell);
+
+  return bytes;
 }
 
 void SuperRegion::DrawOccupancy(void) const
@@ -88,9 +206,7 @@ void SuperRegion::DrawOccupancy(void) const
         // draw a rectangle around each occupied cell
         for (int p = 0; p < REGIONWIDTH; ++p)
           for (int q = 0; q < REGIONWIDTH; ++q) {
-            const Cell &c = r->cells[p + (q * REGIONWIDTH)];
-
-            if (c.blocks[0].size()) // layer 0
+            if (r->Occupied(0, p, q) || r->Occupied(STATIC_LAYER, p, q)) // layer 0 or static
             {
               const GLfloat xx = p + (x << RBITS);
               const GLfloat yy = q + (y << RBITS);
@@ -105,7 +221,7 @@ void SuperRegion::DrawOccupancy(void) const
               rects.push_back(yy + 1);
             }
 
-            if (c.blocks[1].size()) // layer 1
+            if (r->Occupied(1, p, q)) // layer 1
             {
               const GLfloat xx = p + (x << RBITS);
               const GLfloat yy = q + (y << RBITS);
@@ -223,31 +339,35 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
   std::vector<GLfloat> colors(1000);
 
   const Region *r = &regions[0];
+  const unsigned int layers[2] = { layer, STATIC_LAYER };
 
   for (int y = 0; y < SUPERREGIONWIDTH; ++y)
     for (int x = 0; x < SUPERREGIONWIDTH; ++x) {
       if (r->count) // not an empty region
         for (int p = 0; p < REGIONWIDTH; ++p)
           for (int q = 0; q < REGIONWIDTH; ++q) {
-            const std::vector<Block *> &blocks = r->cells[p + (q * REGIONWIDTH)].blocks[layer];
-
-            if (blocks.size()) // not an empty cell
-            {
-              const GLfloat xx(p + (x << RBITS));
-              const GLfloat yy(q + (y << RBITS));
-
-              FOR_EACH (it, blocks) {
-                Block *block = *it;
-                Color c = block->group->mod.GetColor();
-
-                const std::vector<GLfloat> v =
-                    DrawBlock(xx, yy, block->global_z.min, block->global_z.max);
-                verts.insert(verts.end(), v.begin(), v.end());
-
-                for (unsigned int i = 0; i < 20; i++) {
-                  colors.push_back(c.r);
-                  colors.push_back(c.g);
-                  colors.push_back(c.b);
+            // draw the moving and static blocks in this cell
+            for (unsigned int l = 0; l < 2; ++l) {
+              const CellBlocks &blocks = r->cells[p + (q * REGIONWIDTH)].blocks[layers[l]];
+
+              if (blocks.size()) // not an empty cell
+              {
+                const GLfloat xx(p + (x << RBITS));
+                const GLfloat yy(q + (y << RBITS));
+
+                FOR_EACH (it, blocks) {
+                  Block *block = *it;
+                  Color c = block->group->mod.GetColor();
+
+                  const std::vector<GLfloat> v =
+                      DrawBlock(xx, yy, block->global_z.min, block->global_z.max);
+                  verts.insert(verts.end(), v.begin(), v.end());
+
+                  for (unsigned int i = 0; i < 20; i++) {
+                    colors.push_back(c.r);
+                    colors.push_back(c.g);
+                    colors.push_back(c.b);
+                  }
                 }
               }
             }
@@ -274,7 +394,7 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
 void Stg::Cell::AddBlock(Block *b, unsigned int layer)
 {
   assert(b);
-  assert(layer < 2);
+  assert(layer < LAYER_COUNT);
 
   //  printf( "cell %p add block %p vec %u\n", this, b, (unsigned
   //  int)blocks[layer].size() );
@@ -305,15 +425,21 @@ void Stg::Cell::AddBlock(Block *b, unsigned int layer)
   // 	   (int)cbrecords[layer][i].used );
   //  puts("");
 
-  blocks[layer].push_back(b);
+  InsertBlock(b, layer);
   b->rendered_cells[layer].push_back(this);
+}
+
+void Stg::Cell::InsertBlock(Block *b, unsigned int layer)
+{
+  blocks[layer].push_back(b, region->superregion->arena);
+  region->SetOccupied(this, layer, true);
   region->AddBlock();
 }
 
 void Stg::Cell::RemoveBlock(Block *b, unsigned int layer)
 {
   assert(b);
-  assert(layer < 2);
+  assert(layer < LAYER_COUNT);
 
   //  printf( "cell %p remove block %p vec %u\n", this, b, (unsigned
   //  int)blocks[layer].size() );
@@ -349,44 +475,11 @@ void Stg::Cell::RemoveBlock(Block *b, unsigned int layer)
   // 	   (int)cbrecords[layer][i].used );
   //  puts("");
 
-  std::vector<Block *> &blks(blocks[layer]);
-  const size_t len(blks.size());
-  if (len) {
-#if 0
-      // Use conventional STL style
-
-      // this special-case test is faster for worlds with simple models,
-      // which are the ones we want to be really fast. It's a small
-      // extra cost for worlds with several models in each cell. It
-      // gives a 5% overall speed increase in fasr.world.
-
-      if( (blks.size() == 1) &&
-	  (blks[0] == b) ) // special but common case
-	{
-	  blks.clear(); // cheap
-	}
-      else // the general but relatively expensive case
-	{
-	  EraseAll( b, blks );
-	}
-#else
-    // attempt faster removal loop
-    // O(n) * low constant array element removal
-    // this C-style pointer work looks to be very slightly faster than the STL
-    // way
-    Block **start = &blks[0]; // start of array
-    Block **r = &blks[0]; // read from here
-    Block **w = &blks[0]; // write to here
-
-    while (r < start + len) // scan down array, skipping 'this'
-    {
-      if (*r != b)
-        *w++ = *r;
-      ++r;
-    }
-    blks.resize(w - start);
-#endif
-  }
+  CellBlocks &blks(blocks[layer]);
+  blks.remove(b, region->superregion->arena);
+
+  if (blks.empty())
+    region->SetOccupied(this, layer, false);
 
   region->RemoveBlock();
 }
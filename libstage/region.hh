@@ -10,7 +10,7 @@
 namespace Stg {
 
 // a bit of experimenting suggests that these values are fast. YMMV.
-const uint32_t RBITS(5); // regions contain (2^RBITS)^2 pixels
+const uint32_t RBITS(5); // regions contain (2^RBITS)^2 pixels (at most 5, see Region::occupied)
 const uint32_t SBITS(5); // superregions contain (2^SBITS)^2 regions
 const uint32_t SRBITS(RBITS + SBITS);
 
@@ -39,26 +39,86 @@ inline int32_t GETSREG(const int32_t x)
 // this is slightly faster than the inline method above, but not as safe
 //#define GETREG(X) (( (static_cast<int32_t>(X)) & REGIONMASK ) >> RBITS)
 
+/** Hands out arrays of block pointers to cells whose block lists
+    have outgrown their inline storage. Arrays are carved from large
+    slabs and recycled through free lists, one per power-of-two
+    size, so cells never allocate from the heap themselves. Each
+    SuperRegion has its own arena. Robots in different parts of a
+    superregion may be moved in parallel, so these calls are
+    serialized with a mutex. */
+class BlockArena {
+public:
+  BlockArena();
+  ~BlockArena();
+
+  /** Returns an array of cap block pointers. cap must be a power of two. */
+  Block **Alloc(uint32_t cap);
+  /** Return an array obtained from Alloc() with the same cap. */
+  void Free(Block **array, uint32_t cap);
+
+  /** Number of bytes of memory held by the arena. */
+  size_t Bytes() const { return bytes; }
+private:
+  static const uint32_t SLABSIZE = 4096; // block pointers per slab
+  static const uint32_t CLASSES = 32; // one free list per power of two
+
+  std::vector<Block **> slabs;
+  Block **free_lists[CLASSES]; // singly linked through the first element
+  Block **next; // unused space in the current slab
+  size_t remaining;
+  size_t bytes;
+  pthread_mutex_t mutex;
+};
+
+/** The list of blocks rendered into a cell in one layer. Most cells
+    hold only one or two blocks, so these are stored inline and the
+    list only spills into its superregion's BlockArena when it
+    grows. */
+class CellBlocks {
+public:
+  typedef Block *const *const_iterator;
+
+  CellBlocks() : len(0), cap(INLINE) { data.local[0] = data.local[1] = NULL; }
+  const_iterator begin() const { return Data(); }
+  const_iterator end() const { return Data() + len; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+  void push_back(Block *b, BlockArena &arena);
+  /** Remove all instances of b, preserving the order of the others. */
+  void remove(Block *b, BlockArena &arena);
+
+  /** Number of bytes used outside the cell for this list */
+  size_t ArenaBytes() const { return cap > INLINE ? cap * sizeof(Block *) : 0; }
+private:
+  static const uint32_t INLINE = 2;
+
+  union {
+    Block *local[INLINE];
+    Block **arena;
+  } data;
+  uint32_t len, cap;
+
+  Block *const *Data() const { return cap > INLINE ? data.arena : data.local; }
+  Block **Data() { return cap > INLINE ? data.arena : data.local; }
+};
+
 class Cell {
   friend class SuperRegion;
   friend class World;
 
 private:
-  std::vector<Block *> blocks[2];
+  CellBlocks blocks[LAYER_COUNT];
 
 public:
-  Cell() : blocks(), region(NULL)
-  {
-    // prevent frequent memory allocations
-    blocks[0].reserve(8);
-    blocks[1].reserve(8);
-    /* nothing to do */
-  }
-
+  Cell() : blocks(), region(NULL) { /* nothing to do */}
   void RemoveBlock(Block *b, unsigned int index);
   void AddBlock(Block *b, unsigned int index);
+  /** As AddBlock(), but the block's list of its cells is left to the
+      caller, so that threads mapping different superregions can add
+      the same block at once. */
+  void InsertBlock(Block *b, unsigned int index);
 
-  inline const std::vector<Block *> &GetBlocks(unsigned int index) { return blocks[index]; }
+  inline const CellBlocks &GetBlocks(unsigned int index) { return blocks[index]; }
   Region *region;
 }; // class Cell
 
@@ -70,10 +130,40 @@ private:
   std::vector<Cell> cells;
   unsigned long count; // number of blocks rendered into this region
 
+  // occupancy bitmaps, one per layer: bit x of word y is set iff
+  // cell (x,y) holds any blocks in that layer. These let the
+  // raytracer skip empty cells without touching the Cell data.
+  uint32_t occupied[LAYER_COUNT][REGIONWIDTH];
+  unsigned int occupied_count[LAYER_COUNT]; // number of bits set in each bitmap
+
 public:
   Region();
   ~Region();
 
+  /** Returns true iff cell (x,y) holds any blocks in the layer */
+  inline bool Occupied(unsigned int layer, int32_t x, int32_t y) const
+  {
+    return occupied[layer][y] & (1u << x);
+  }
+
+  /** Returns true iff any cell holds blocks in the layer */
+  inline bool Occupied(unsigned int layer) const { return occupied_count[layer] > 0; }
+  /** Update the occupancy bit of cell c in the layer */
+  inline void SetOccupied(const Cell *c, unsigned int layer, bool on)
+  {
+    const int32_t index(c - &cells[0]);
+    uint32_t &word(occupied[layer][index >> RBITS]);
+    const uint32_t bit(1u << (index & (REGIONWIDTH - 1)));
+
+    if (on && !(word & bit)) {
+      word |= bit;
+      ++occupied_count[layer];
+    } else if (!on && (word & bit)) {
+      word &= ~bit;
+      --occupied_count[layer];
+    }
+  }
+
   inline Cell *GetCell(int32_t x, int32_t y)
   {
     if (cells.size() == 0) {
@@ -114,6 +204,11 @@ public:
   inline void RemoveBlock();
 
   const point_int_t &GetOrigin() const { return origin; }
+  /** Number of bytes of memory used by this superregion's occupancy data */
+  size_t MemoryUsage() const;
+
+  /** Storage for cell block lists that outgrow their inline space */
+  BlockArena arena;
 }; // class SuperRegion;
 
 } // namespace Stg
@@ -42,6 +42,103 @@ bool Stg::InitDone()
   return init_called;
 }
 
+// see Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+// SC'11. The blocks for successive counters are independent, so
+// they are generated side by side with the blocks in the inner
+// loops, where the compiler can vectorize them.
+void RandomStream::Blocks(uint32_t *out, size_t count)
+{
+  const size_t BATCH(64);
+  uint32_t c0[BATCH], c1[BATCH], c2[BATCH], c3[BATCH];
+
+  for (size_t done(0); done < count; done += BATCH) {
+    const size_t n(std::min(BATCH, count - done));
+
+    for (size_t b(0); b < n; ++b) {
+      const uint64_t ctr(counter + b);
+      c0[b] = uint32_t(ctr);
+      c1[b] = uint32_t(ctr >> 32);
+      c2[b] = 0;
+      c3[b] = 0;
+    }
+
+    uint32_t k0(key), k1(key >> 32);
+    for (int round = 0; round < 10; ++round) {
+      for (size_t b(0); b < n; ++b) {
+        const uint64_t p0(uint64_t(0xD2511F53) * c0[b]);
+        const uint64_t p1(uint64_t(0xCD9E8D57) * c2[b]);
+
+        c0[b] = uint32_t(p1 >> 32) ^ c1[b] ^ k0;
+        c1[b] = uint32_t(p1);
+        c2[b] = uint32_t(p0 >> 32) ^ c3[b] ^ k1;
+        c3[b] = uint32_t(p0);
+      }
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+
+    for (size_t b(0); b < n; ++b) {
+      uint32_t *o(out + 4 * (done + b));
+      o[0] = c0[b];
+      o[1] = c1[b];
+      o[2] = c2[b];
+      o[3] = c3[b];
+    }
+
+    counter += n;
+  }
+}
+
+void RandomStream::Uniform(double *out, size_t n)
+{
+  used = 4; // start from a fresh block
+
+  // each block makes two 53 bit numbers
+  const size_t BATCH(64);
+  uint32_t words[4 * BATCH];
+
+  for (size_t done(0); done < n; done += 2 * BATCH) {
+    const size_t count(std::min(2 * BATCH, n - done));
+    Blocks(words, (count + 1) / 2);
+
+    for (size_t i(0); i < count; ++i)
+      out[done + i] = ((words[2 * i] >> 5) * 67108864.0 + (words[2 * i + 1] >> 6))
+                      * (1.0 / 9007199254740992.0);
+  }
+}
+
+// the Box-Muller transform
+double RandomStream::Gaussian()
+{
+  if (have_spare) {
+    have_spare = false;
+    return spare;
+  }
+
+  const double r(sqrt(-2.0 * log(std::max(Uniform(), 1e-100))));
+  const double theta(2.0 * M_PI * Uniform());
+
+  spare = r * sin(theta);
+  have_spare = true;
+  return r * cos(theta);
+}
+
+void RandomStream::Gaussian(double *out, size_t n)
+{
+  Uniform(out, n);
+
+  // the Box-Muller transform, a pair of uniforms at a time
+  for (size_t i(0); i + 1 < n; i += 2) {
+    const double r(sqrt(-2.0 * log(std::max(out[i], 1e-100))));
+    const double theta(2.0 * M_PI * out[i + 1]);
+    out[i] = r * cos(theta);
+    out[i + 1] = r * sin(theta);
+  }
+
+  if (n % 2)
+    out[n - 1] = Gaussian();
+}
+
 const Color Color::blue(0, 0, 1);
 const Color Color::red(1, 0, 0);
 const Color Color::green(0, 1, 0);
@@ -75,19 +172,14 @@ static inline bool pixel_is_set(uint8_t *pixels, const unsigned int width, const
   return ((pixels + (y * width * depth) + x * depth)[0] > threshold);
 }
 
-double direction(double a)
-{
-  if (a == 0.0)
-    return 0;
-  else
-    return sgn(a);
-}
+// FLTK's shared image cache is not thread safe, so worlds loading
+// several bitmaps at once take turns to decode them
+static pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int Stg::polys_from_image_file(const std::string &filename,
-                               std::vector<std::vector<point_t> > &polys)
+                               std::vector<std::vector<point_t> > &polys, uint8_t threshold)
 {
-  // TODO: make this a parameter
-  const int threshold = 127;
+  pthread_mutex_lock(&image_mutex);
 
   Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
   if (img == NULL) {
@@ -105,112 +197,92 @@ int Stg::polys_from_image_file(const std::string &filename,
   const unsigned int depth = img->d();
   uint8_t *pixels = (uint8_t *)img->data()[0];
 
-  // a set of previously seen directed edges, The key is a 4-element vector
-  // [x1,y1,x2,y2].
-  std::set<std::vector<uint32_t> > edges;
+  // threshold the image into rows of one byte per pixel, with a
+  // blank border one pixel wide so that neighbours can be tested
+  // without bounds checks. Non-zero means dark (occupied).
+  const unsigned int stride = width + 2;
+  std::vector<uint8_t> dark(stride * (height + 2), 0);
+
+  for (unsigned int y = 0; y < height; y++) {
+    uint8_t *row = &dark[(y + 1) * stride + 1];
+    for (unsigned int x = 0; x < width; x++)
+      row[x] = !pixel_is_set(pixels, width, depth, x, y, threshold);
+  }
+
+  img->release(); // frees all resources for this image
+
+  pthread_mutex_unlock(&image_mutex);
+
+  // Every boundary between a dark and a blank pixel is a directed
+  // edge between two pixel corners, oriented so that the dark pixel
+  // is on its right (image y points down). For each corner we keep
+  // a bitmask of the directions of its untraced outgoing edges:
+  // bit 0 is +x, bit 1 is +y, bit 2 is -x and bit 3 is -y. A corner
+  // has two outgoing edges only where dark pixels touch diagonally.
+  const unsigned int cwidth = width + 1;
+  std::vector<uint8_t> out(cwidth * (height + 1), 0);
 
   for (unsigned int y = 0; y < height; y++) {
+    const uint8_t *row = &dark[(y + 1) * stride + 1];
+    uint8_t *corner = &out[y * cwidth];
+
     for (unsigned int x = 0; x < width; x++) {
-      // skip blank (white) pixels
-      if (pixel_is_set(pixels, width, depth, x, y, threshold))
+      if (!row[x])
         continue;
 
-      // generate the four directed edges for this pixel
-      std::vector<uint32_t> edge[4];
-
-      for (int i = 0; i < 4; i++)
-        edge[i].resize(4);
-
-      edge[0][0] = x + 0;
-      edge[0][1] = y + 0;
-      edge[0][2] = x + 1;
-      edge[0][3] = y + 0;
-
-      edge[1][0] = x + 1;
-      edge[1][1] = y + 0;
-      edge[1][2] = x + 1;
-      edge[1][3] = y + 1;
-
-      edge[2][0] = x + 1;
-      edge[2][1] = y + 1;
-      edge[2][2] = x + 0;
-      edge[2][3] = y + 1;
-
-      edge[3][0] = x + 0;
-      edge[3][1] = y + 1;
-      edge[3][2] = x + 0;
-      edge[3][3] = y + 0;
-
-      // put them in the set of the inverse edge does not exist
-      for (int i = 0; i < 4; i++) {
-        // the same edge with the opposite direction
-        std::vector<uint32_t> inv(4);
-        inv[0] = edge[i][2];
-        inv[1] = edge[i][3];
-        inv[2] = edge[i][0];
-        inv[3] = edge[i][1];
-
-        std::set<std::vector<uint32_t> >::iterator it = edges.find(inv);
-
-        if (it == edges.end()) // inverse not found
-          edges.insert(edge[i]); // add the new edge
-        else // inverse found! delete it
-          edges.erase(it);
-      }
+      if (!row[int(x) - int(stride)]) // top
+        corner[x] |= 1;
+      if (!row[x + 1]) // right
+        corner[x + 1] |= 2;
+      if (!row[x + stride]) // bottom
+        corner[x + 1 + cwidth] |= 4;
+      if (!row[int(x) - 1]) // left
+        corner[x + cwidth] |= 8;
     }
   }
 
-  std::multimap<point_t, point_t> mmap;
+  // Trace each closed contour once, emitting a vertex only where the
+  // contour turns, so straight runs of pixels become single edges. At
+  // a diagonal touch we turn right, towards the dark pixel, which
+  // keeps diagonally adjacent shapes in separate polygons. Each edge
+  // is visited exactly once, so this is linear in the image size.
+  const int step[4] = { 1, int(cwidth), -1, -int(cwidth) };
 
-  FOR_EACH (it, edges) {
-    // fill a multimap with start-point / end-point pairs.
-    std::pair<point_t, point_t> p(point_t((*it)[0], (*it)[1]), point_t((*it)[2], (*it)[3]));
-    mmap.insert(p);
-  }
+  for (unsigned int seed = 0; seed < out.size(); seed++)
+    while (out[seed]) {
+      std::vector<point_t> poly;
 
-  for (std::multimap<point_t, point_t>::iterator seedit = mmap.begin(); seedit != mmap.end();
-       seedit = mmap.begin()) {
-    std::vector<point_t> poly;
-
-    while (seedit != mmap.end()) {
-      // invert y axis and add the new point to the poly
-      point_t pt = seedit->first;
-      pt.y = -pt.y;
-
-      // can this vector simply extend the previous one?
-      size_t psize = poly.size();
-      if (psize > 2) // need at least two points already
-      {
-        // find the direction of the vector descrived by the two previous points
-        double ldx = direction(poly[psize - 1].x - poly[psize - 2].x);
-        double ldy = direction(poly[psize - 1].y - poly[psize - 2].y);
-
-        // find the direction of the vector described by the new point and the
-        // previous point
-        double ndx = direction(pt.x - poly[psize - 1].x);
-        double ndy = direction(pt.y - poly[psize - 1].y);
-
-        // if the direction is the same, we can replace the
-        // previous point with this one, rather than adding a
-        // new point
-        if (ldx == ndx && ldy == ndy)
-          poly[psize - 1] = pt;
-        else
-          poly.push_back(pt);
-      } else
-        poly.push_back(pt);
-
-      point_t next = seedit->second;
-      mmap.erase(seedit);
-
-      seedit = mmap.find(next);
-    }
+      unsigned int c = seed;
+      int d = 0;
+      while (!(out[c] & (1 << d)))
+        d++;
 
-    polys.push_back(poly);
-  }
+      const int first = d;
+      int last = -1;
+
+      do {
+        out[c] &= ~(1 << d);
+
+        if (d != last) // the contour turns here
+          poly.push_back(point_t(c % cwidth, -double(c / cwidth))); // invert y axis
+        last = d;
+
+        c += step[d];
+
+        const uint8_t o = out[c];
+        if (o & (1 << ((d + 1) & 3)))
+          d = (d + 1) & 3; // right
+        else if (o & (1 << ((d + 3) & 3)) && !(o & (1 << d)))
+          d = (d + 3) & 3; // left
+      } while (c != seed);
+
+      // the seed lies in the middle of a straight run
+      if (last == first && poly.size() > 2)
+        poly.erase(poly.begin());
+
+      polys.push_back(poly);
+    }
 
-  if (img)
-    img->release(); // frees all resources for this image
   return 0; // ok
 }
 
@@ -211,6 +211,8 @@ typedef double joules_t;
 /** Watts: unit of power (energy/time) */
 typedef double watts_t;
 
+class RandomStream;
+
 class Color {
 public:
   double r, g, b, a;
@@ -227,16 +229,75 @@ instead.  */
   bool operator!=(const Color &other) const;
   bool operator==(const Color &other) const;
   static Color RandomColor();
+  /** As above, drawing from the stream rng */
+  static Color RandomColor(RandomStream &rng);
   void Print(const char *prefix) const;
 
   /** convenient constants */
   static const Color blue, red, green, yellow, magenta, cyan;
 
   const Color &Load(Worldfile *wf, int entity);
+  /** As above, drawing a "random" color from the stream rng */
+  const Color &Load(Worldfile *wf, int entity, RandomStream &rng);
 
   void GLSet(void) { glColor4f(r, g, b, a); }
 };
 
+/** A stream of pseudo-random numbers from the Philox4x32-10
+    counter-based generator. Each number depends only on the key and
+    its position in the stream, so streams with the same key give the
+    same numbers in every run, whichever thread draws them. */
+class RandomStream {
+public:
+  explicit RandomStream(uint64_t key = 0) { Seed(key); }
+  /** Restart the stream with a new key */
+  void Seed(uint64_t key)
+  {
+    this->key = key;
+    counter = 0;
+    used = 4;
+    have_spare = false;
+  }
+
+  /** Returns 32 random bits */
+  uint32_t Next()
+  {
+    if (used == 4)
+      Refill();
+    return block[used++];
+  }
+
+  /** Returns a number uniformly distributed in [0,1) */
+  double Uniform()
+  {
+    const uint32_t a(Next() >> 5), b(Next() >> 6);
+    return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0); // 53 bits
+  }
+
+  /** Returns a normally distributed number with zero mean and unit
+      variance */
+  double Gaussian();
+
+  /** Fill out with n numbers uniformly distributed in [0,1). Much
+      faster than n calls of Uniform(). */
+  void Uniform(double *out, size_t n);
+  /** Fill out with n normally distributed numbers with zero mean and
+      unit variance. Much faster than n calls of Gaussian(). */
+  void Gaussian(double *out, size_t n);
+
+private:
+  /** Generate the next block of four numbers */
+  void Refill() { Blocks(block, 1); used = 0; }
+  /** Generate the next count blocks of four numbers into out */
+  void Blocks(uint32_t *out, size_t count);
+
+  uint64_t key, counter;
+  uint32_t block[4];
+  unsigned int used; ///< numbers of block already returned
+  bool have_spare; ///< the Box-Muller transform makes normals in pairs
+  double spare;
+};
+
 /** specify a rectangular size */
 class Size {
 public:
@@ -272,6 +333,15 @@ angle random */
                 normalize(drand48() * (2.0 * M_PI)));
   }
 
+  /** As above, but drawing from the stream rng */
+  static Pose Random(meters_t xmin, meters_t xmax, meters_t ymin, meters_t ymax,
+                     RandomStream &rng)
+  {
+    const meters_t x(xmin + rng.Uniform() * (xmax - xmin));
+    const meters_t y(ymin + rng.Uniform() * (ymax - ymin));
+    return Pose(x, y, 0, normalize(rng.Uniform() * (2.0 * M_PI)));
+  }
+
   /** Print pose in human-readable format on stdout
 @param prefix Character string to prepend to pose output
   */
@@ -560,8 +630,10 @@ typedef struct {
 } rotrect_t; /// rotated rectangle
 
 /** load the image file [filename] and convert it to a vector of polygons
+    outlining the pixels no brighter than [threshold]
    */
-int polys_from_image_file(const std::string &filename, std::vector<std::vector<point_t> > &polys);
+int polys_from_image_file(const std::string &filename, std::vector<std::vector<point_t> > &polys,
+                          uint8_t threshold = 127);
 
 /** matching function should return true iff the candidate block is
       stops the ray, false if the block transmits the ray
@@ -725,6 +797,23 @@ public:
   bool ztest;
 };
 
+/** Ray predicate functor that calls a ray_test_func_t. The templated
+World::Raytrace() variants take a functor like this one, so that
+simple predicates can be inlined into the raytracer's inner loop;
+see also RayMatchUnrelated, RayMatchRanger and RayMatchGripper. */
+class RayMatchFunc {
+public:
+  RayMatchFunc(ray_test_func_t func, const void *arg) : func(func), arg(arg) {}
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (*func)(candidate, finder, arg);
+  }
+
+private:
+  ray_test_func_t func;
+  const void *arg;
+};
+
 // defined in stage_internal.hh
 class Region;
 class SuperRegion;
@@ -760,12 +849,176 @@ public:
 
 class ModelPosition;
 
+/** A constant-time directory of superregions keyed by superregion
+    coordinates: an open-addressing hash table with linear
+    probing. This sits inside the raytracing and MapPoly loops, where
+    a std::map lookup was a costly tree walk.
+
+    Sensors may call Find() from worker threads while a model moving
+    on the main thread enters a new superregion. So when the table
+    grows, the new one is filled in and then published by swapping a
+    pointer, and the old one is kept until Reclaim() is called at a
+    point where no other thread can be reading it. */
+class SuperRegionIndex {
+public:
+  SuperRegionIndex() : slots(new std::vector<Slot>(MIN_SLOTS)), retired(), all() {}
+  ~SuperRegionIndex();
+
+  /** Returns the superregion at org, or NULL if there is none. */
+  SuperRegion *Find(const point_int_t &org) const
+  {
+    const std::vector<Slot> &table(*slots);
+    const size_t mask(table.size() - 1);
+    for (size_t i(Hash(org) & mask);; i = (i + 1) & mask) {
+      const Slot &s(table[i]);
+      if (s.sr == NULL || s.org == org)
+        return s.sr;
+    }
+  }
+
+  /** Add sr to the index at org, which must not be present already. */
+  void Insert(const point_int_t &org, SuperRegion *sr);
+
+  /** Remove the superregion at org, if any. */
+  void Erase(const point_int_t &org);
+
+  /** Free the tables replaced as the index grew. Call only when no
+      other thread can be in Find(). */
+  void Reclaim();
+
+  /** All the superregions in the index, in order of insertion. */
+  const std::vector<SuperRegion *> &All() const { return all; }
+  size_t Size() const { return all.size(); }
+
+private:
+  class Slot {
+  public:
+    point_int_t org;
+    SuperRegion *sr;
+    Slot() : org(), sr(NULL) {}
+  };
+
+  static const size_t MIN_SLOTS = 64; // must be a power of two
+
+  std::vector<Slot> *volatile slots; ///< the current table
+  std::vector<std::vector<Slot> *> retired; ///< tables that may still be read
+  std::vector<SuperRegion *> all;
+
+  // not copyable
+  SuperRegionIndex(const SuperRegionIndex &);
+  SuperRegionIndex &operator=(const SuperRegionIndex &);
+
+  static size_t Hash(const point_int_t &p)
+  {
+    return (uint32_t)p.x * 73856093u ^ (uint32_t)p.y * 19349663u;
+  }
+
+  void Grow();
+  /** Make table the current one, retiring the old one */
+  void Publish(std::vector<Slot> *table);
+};
+
+/** A buffer of ray segments recorded for debug visualization. The
+    segments are stored as x1,y1,x2,y2 in one contiguous array that
+    is allocated once, on first use, and can be drawn with a single
+    glDrawArrays(). When the buffer is full further segments are
+    dropped and counted. */
+class RayRecord {
+public:
+  static const size_t CAPACITY = 1 << 16; ///< the most segments held
+
+  RayRecord() : points(), count(0), dropped(0) {}
+
+  void Add(float x1, float y1, float x2, float y2)
+  {
+    if (count == CAPACITY) {
+      ++dropped;
+      return;
+    }
+
+    if (points.empty())
+      points.resize(4 * CAPACITY);
+
+    float *p(&points[4 * count++]);
+    p[0] = x1;
+    p[1] = y1;
+    p[2] = x2;
+    p[3] = y2;
+  }
+
+  void Clear() { count = 0; }
+  /** The recorded segments, 4 floats each */
+  const float *Points() const { return points.empty() ? NULL : &points[0]; }
+  size_t Count() const { return count; }
+  /** The number of segments dropped because the buffer was full */
+  uint64_t Dropped() const { return dropped; }
+
+private:
+  std::vector<float> points;
+  size_t count;
+  uint64_t dropped;
+};
+
+/** An index of models by the position of their global pose, for
+    finding the models near a point without testing them all. Models
+    are filed in the cells of a uniform grid, and the cells are hashed
+    into a fixed array of buckets. The owner calls Move() for each
+    model whose pose has changed. */
+class SpatialHash {
+public:
+  explicit SpatialHash(meters_t cell_size, size_t bucket_count = 1024);
+
+  /** Add mod to the index, which must not be present already. */
+  void Insert(Model *mod);
+  /** Remove mod from the index, if present. */
+  void Erase(Model *mod);
+  /** Re-file mod if it has moved into a different cell. Models that
+      are not in the index are ignored. */
+  void Move(Model *mod);
+
+  /** Append to found the models whose global poses are within radius
+      of centre. Only the cells between the lowest and highest filed
+      so far are visited, and if that is more cells than there are
+      models, the models are tested directly. */
+  void Query(const point_t &centre, meters_t radius, std::vector<Model *> &found) const;
+
+private:
+  class Entry {
+  public:
+    Model *mod;
+    point_int_t cell; ///< the cell mod is filed under
+    Entry(Model *mod, const point_int_t &cell) : mod(mod), cell(cell) {}
+  };
+
+  meters_t cell_size;
+  std::vector<std::vector<Entry> > buckets; ///< size is a power of two
+  std::vector<Entry> members; ///< every model in the index
+  std::map<Model *, size_t> positions; ///< the index of each model in members
+  point_int_t lo, hi; ///< bounds of the cells filed since the last Erase()
+
+  point_int_t CellOf(const Model *mod) const;
+  /** Extend lo and hi to cover cell */
+  void Cover(const point_int_t &cell);
+  std::vector<Entry> &Bucket(const point_int_t &cell)
+  {
+    return buckets[((uint32_t)cell.x * 73856093u ^ (uint32_t)cell.y * 19349663u)
+                   & (buckets.size() - 1)];
+  }
+  const std::vector<Entry> &Bucket(const point_int_t &cell) const
+  {
+    return const_cast<SpatialHash *>(this)->Bucket(cell);
+  }
+  /** Remove mod's entry from the bucket of cell */
+  void Unfile(Model *mod, const point_int_t &cell);
+};
+
 /// %World class
 class World : public Ancestor {
 public:
   friend class Block;
   friend class Model; // allow access to private members
   friend class ModelFiducial;
+  friend class ModelRanger;
   friend class Canvas;
   friend class WorkerThread;
 
@@ -797,37 +1050,110 @@ private:
 avoids searching the whole world for fiducials. */
   std::vector<Model *> models_with_fiducials;
 
-  struct ltx {
-    bool operator()(const Model *a, const Model *b) const;
-  };
+  /** Index of the models with fiducials by position, for quickly
+finding nearby fiducials. Brought up to date at the start of each
+update. */
+  SpatialHash fiducial_index;
 
-  struct lty {
-    bool operator()(const Model *a, const Model *b) const;
+  /** Models with fiducials whose poses were changed by each thread
+      since the last update, to be re-filed in fiducial_index. */
+  std::vector<std::vector<Model *> > moved_fiducials;
+
+  /** Remembers the most recent superregion lookup made by a
+raytrace, so that consecutive lookups of the same superregion, as
+made by neighbouring rays in a fan, skip the superregion map. */
+  class SuperRegionCache {
+  public:
+    point_int_t origin;
+    SuperRegion *sr;
+    bool valid;
+
+    SuperRegionCache() : origin(), sr(NULL), valid(false) {}
   };
 
-  /** maintain a set of models with fiducials sorted by pose.x, for
-quickly finding nearby fidcucials */
-  std::set<Model *, ltx> models_with_fiducials_byx;
+  /** Trace a ray along the heading with sine sina and cosine cosa,
+using and updating the superregion cache. This is the inner loop
+shared by all the Raytrace() variants. The predicate and the
+z-test are template parameters so they compile into the loop, as
+is MEASURE, which when false leaves the range and colour of a hit
+unset for callers that only need the model. */
+  template <class Pred, bool ZTEST, bool MEASURE>
+  RaytraceResult TraceRay(const Ray &r, const Pred &pred, const double sina, const double cosa,
+                          SuperRegionCache &cache);
+
+  // The raytracers below are templated on the predicate, but they are
+  // defined in world.cc and instantiated there only for the RayMatch
+  // functors, so they are private. Model, and the models that trace
+  // rays from the world directly, are friends.
+
+  /** trace a ray, testing blocks with the functor pred instead of
+ray.func and ray.arg. Instantiated for RayMatchFunc,
+RayMatchUnrelated, RayMatchRanger and RayMatchGripper. */
+  template <class Pred> RaytraceResult Raytrace(const Ray &ray, const Pred &pred);
+
+  /** As RaytraceFan(), testing blocks with the functor pred instead of
+ray.func and ray.arg. Instantiated for the same functors as the
+templated Raytrace(). */
+  template <class Pred>
+  void RaytraceFan(const Ray &ray, const std::vector<radians_t> &angles,
+                   std::vector<RaytraceResult> &results, const Pred &pred);
+
+  /** Test the line of sight from the point of pose (at height
+pose.z for the z-test) to the point to. Returns the first model
+matched by pred that crosses the line, or NULL if the line is
+clear. Cheaper than a Raytrace(), as the trace stops at to and the
+hit is not measured. Instantiated for the same functors as the
+templated Raytrace(). */
+  template <class Pred>
+  Model *LineOfSight(const Pose &pose, const point_t &to, const Pred &pred, const Model *finder,
+                     const bool ztest);
+
+  /** Perform multiple raytraces evenly spaced over the field of view,
+testing blocks with the functor pred. */
+  template <class Pred>
+  void Raytrace(const Pose &gpose, const meters_t range, const radians_t fov, const Pred &pred,
+                const Model *model, const bool ztest, std::vector<RaytraceResult> &results)
+  {
+    const size_t sample_count(results.size());
 
-  /** maintain a set of models with fiducials sorted by pose.y, for
-quickly finding nearby fidcucials */
-  std::set<Model *, lty> models_with_fiducials_byy;
+    // find the direction of the first ray
+    const double starta(fov / 2.0 - gpose.a);
+
+    std::vector<radians_t> angles(sample_count);
+    for (size_t s(0); s < sample_count; ++s)
+      angles[s] = (s * fov / (double)(sample_count - 1)) - starta;
+
+    RaytraceFan(Ray(model, gpose, range, NULL, NULL, ztest), angles, results, pred);
+  }
 
   /** Add a model to the set of models with non-zero fiducials, if not already there. */
   void FiducialInsert(Model *mod)
   {
     FiducialErase(mod); // make sure it's not there already
     models_with_fiducials.push_back(mod);
+    fiducial_index.Insert(mod);
   }
 
   /** Remove a model from the set of models with non-zero fiducials, if it exists. */
-  void FiducialErase(Model *mod) { EraseAll(mod, models_with_fiducials); }
+  void FiducialErase(Model *mod)
+  {
+    EraseAll(mod, models_with_fiducials);
+    fiducial_index.Erase(mod);
+  }
+
+  /** Note that a model with fiducials has changed its pose. Safe to
+      call from the worker threads. */
+  void FiducialMoved(Model *mod) { moved_fiducials[CurrentThread()].push_back(mod); }
+
   /// Defines what all World::Load(*) methods have in common. Called after initial setup.
   void LoadWorldPostHook();
 
   double ppm; ///< the resolution of the world model in pixels per meter
   bool quit; ///< quit this world ASAP
   bool show_clock; ///< iff true, print the sim time on stdout
+  bool deterministic; ///< iff true, runs give the same results with any number of threads
+  uint32_t random_seed; ///< the key of every model's random number stream
+  std::string bitmap_cache; ///< directory of cached bitmap polygons, or empty for none
   unsigned int show_clock_interval; ///< updates between clock outputs
 
   //--- thread sync ----
@@ -837,6 +1163,14 @@ quickly finding nearby fidcucials */
   pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
   int total_subs; ///< the total number of subscriptions to all models
   unsigned int worker_threads; ///< the number of worker threads to use
+  std::vector<double> worker_busy; ///< seconds each worker thread has spent running events
+  double load_started; ///< wall clock time in seconds when Load() was called
+  bool loading; ///< true while the models of a world file are being created
+
+  /** Key holding the index of the calling worker thread, which is 0
+      for the main thread. */
+  static pthread_key_t thread_key;
+  static void CreateThreadKey() { pthread_key_create(&thread_key, NULL); }
 
 protected:
   std::list<std::pair<world_callback_t, void *> >
@@ -849,9 +1183,23 @@ protected:
       powerpack_list; ///< List of all the powerpacks attached to models in the world
   /** World::quit is set true when this simulation time is reached */
   usec_t quit_time;
-  std::list<float *> ray_list; ///< List of rays traced for debug visualization
+  /** Rays traced for debug visualization, one buffer per thread */
+  std::vector<RayRecord> ray_records;
+
+  /** Buffers reused by Block::ReMap(), so that moving a block does not
+      allocate once they have grown */
+  class MapScratch {
+  public:
+    std::vector<point_int_t> pts;
+    std::vector<point_int_t> pixels;
+    std::vector<Cell *> cells;
+    std::vector<Cell *> added;
+    std::vector<Cell *> removed;
+  };
+  /** One set of ReMap() buffers per thread */
+  std::vector<MapScratch> map_scratch;
   usec_t sim_time; ///< the current sim time in this world in microseconds
-  std::map<point_int_t, SuperRegion *> superregions;
+  SuperRegionIndex superregions;
 
   uint64_t updates; ///< the number of simulated time steps executed so far
   Worldfile *wf; ///< If set, points to the worldfile used to create this world
@@ -907,6 +1255,21 @@ time. */
 the edges of the polygon.*/
   void MapPoly(const std::vector<point_int_t> &poly, Block *block, unsigned int layer);
 
+  /** Fill cells with the raytrace bitmap cells that intersect the
+edges of the polygon, sorted and without duplicates. Cells are
+created as needed. */
+  void PolyCells(const std::vector<point_int_t> &poly, std::vector<Cell *> &cells);
+
+  /** Fill pixels with the coordinates of the cells that intersect the
+edges of the polygon, sorted and without duplicates. Unlike
+PolyCells() this touches no world state, so many threads can call it
+at once. */
+  static void PolyPixels(const std::vector<point_int_t> &poly, std::vector<point_int_t> &pixels);
+
+  /** Fill cells with the cells at the pixel coordinates, sorted and
+without duplicates. Cells are created as needed. */
+  void PixelCells(const std::vector<point_int_t> &pixels, std::vector<Cell *> &cells);
+
   SuperRegion *AddSuperRegion(const point_int_t &coord);
   SuperRegion *GetSuperRegion(const point_int_t &org);
   SuperRegion *GetSuperRegionCreate(const point_int_t &org);
@@ -935,6 +1298,10 @@ grid pixels */
   SuperRegion *CreateSuperRegion(point_int_t origin);
   void DestroySuperRegion(SuperRegion *sr);
 
+  /** Returns the number of bytes of memory used by the occupancy
+      grid used for raytracing and collision detection. */
+  size_t OccupancyMemory() const;
+
   /** trace a ray. */
   RaytraceResult Raytrace(const Ray &ray);
 
@@ -946,6 +1313,22 @@ grid pixels */
                 const Model *model, const void *arg, const bool ztest,
                 std::vector<RaytraceResult> &results);
 
+  /** Trace a fan of rays that share the origin, range, predicate and
+z-test of ray. One ray is traced for each global heading in
+angles, ignoring ray.origin.a, and results is resized to
+match. Much cheaper than tracing the rays one at a time, as the
+origin setup and superregion lookups are shared by the whole fan. */
+  void RaytraceFan(const Ray &ray, const std::vector<radians_t> &angles,
+                   std::vector<RaytraceResult> &results);
+
+  /** Test the line of sight from the point of pose (at height
+pose.z for the z-test) to the point to. Returns the first model for
+which func returns true that crosses the line, or NULL if the line
+is clear. Cheaper than a Raytrace(), as the trace stops at to and the
+hit is not measured. */
+  Model *LineOfSight(const Pose &pose, const point_t &to, const ray_test_func_t func,
+                     const Model *finder, const void *arg, const bool ztest);
+
   /** Enlarge the bounding volume to include this point */
   inline void Extend(point3_t pt);
 
@@ -960,7 +1343,13 @@ grid pixels */
   void ClearRays();
 
   /** store rays traced for debugging purposes */
-  void RecordRay(double x1, double y1, double x2, double y2);
+  void RecordRay(double x1, double y1, double x2, double y2)
+  {
+    ray_records[CurrentThread()].Add(x1, y1, x2, y2);
+  }
+
+  /** Returns the number of debug rays dropped because their buffer was full */
+  uint64_t DroppedRays() const;
 
   /** Returns true iff the current time is greater than the time we
 should quit */
@@ -968,6 +1357,66 @@ should quit */
 
   static void *update_thread_entry(std::pair<World *, int> *info);
 
+  /** The work of loading, in phases that each share their items
+between threads, which take them in turn until there are none left.
+Models vectorize their bitmaps and find the pixels of their blocks
+without touching the world. The blocks' pixels are then split into
+runs by superregion, so that each superregion is mapped by one thread,
+and last each model collects the cells of its blocks. */
+  class LoadJob {
+  public:
+    enum Phase {
+      VECTORIZE, ///< each model: find the polygons of its bitmap
+      RASTERIZE, ///< each model: size it and find the pixels of its blocks
+      MAP, ///< each superregion: add the blocks to its cells
+      FINISH ///< each model: record the cells of its blocks
+    };
+
+    /** The pixels of one block that lie in one superregion */
+    class Span {
+    public:
+      size_t model, block; ///< indices of the model and its block
+      size_t begin, end; ///< range of the block's pixels
+      std::vector<Cell *> cells; ///< the cells of those pixels, found by MAP
+
+      Span(size_t model, size_t block, size_t begin, size_t end)
+          : model(model), block(block), begin(begin), end(end), cells()
+      {
+      }
+    };
+
+    World *world;
+    Phase phase;
+    std::vector<Model *> models; ///< in id order
+    std::vector<std::vector<std::vector<point_t> > > polys; ///< bitmap polygons of each model
+    std::vector<char> vectorized; ///< whether each model's bitmap could be read
+    std::vector<char> cached; ///< whether each model's polygons came from the bitmap cache
+    std::vector<std::vector<std::vector<point_int_t> > > pts; ///< for each block of each model
+    std::vector<std::vector<std::vector<point_int_t> > > pixels; ///< for each block of each model
+    std::vector<SuperRegion *> shards; ///< the superregions the blocks cover
+    std::vector<std::vector<Span> > spans; ///< for each shard
+    /** where to find the spans of each block of each model, as
+        (shard, span) indices */
+    std::vector<std::vector<std::vector<std::pair<size_t, size_t> > > > block_spans;
+    size_t next; ///< index of the next item to be taken
+
+    LoadJob(World *world, const std::set<Model *> &mods);
+
+    /** Do every item of the phase, on the calling thread and threads-1
+        more */
+    void Run(Phase p, unsigned int threads);
+
+    /** Split the blocks' pixels into spans, creating the superregions
+        they need. Must be called on one thread. */
+    void Shard();
+  };
+
+  static void *load_thread_entry(LoadJob *job);
+
+  /** Make models whose blocks have identical shapes share one copy of
+      them. Returns the number of distinct geometries. */
+  size_t ShareGeometry();
+
   class Event {
   public:
     Event(usec_t time, Model *mod, model_callback_t cb, void *arg)
@@ -985,12 +1434,66 @@ should quit */
     bool operator<(const Event &other) const;
   };
 
-  /** Queue of pending simulation events for the main thread to handle. */
-  std::vector<std::priority_queue<Event> > event_queues;
+  /** A queue of events ordered by time. Nearly all events fall on
+      multiples of sim_interval, so these are kept in a timing wheel
+      with one bucket per tick, making push and pop O(1) and letting
+      the events of a tick be drained as a batch. Events at other
+      times, or too far in the future for the wheel, go in a heap. */
+  class EventQueue {
+  public:
+    EventQueue() : tick(0), base(0), wheel(SLOTS), wheel_count(0), heap() {}
+    /** Set the wheel's tick length to interval, starting from time now */
+    void SetTick(usec_t interval, usec_t now);
+    void Push(const Event &ev);
+    bool Empty() const { return wheel_count == 0 && heap.empty(); }
+    /** Append the events due at or before time now to due, in time
+        order. Returns true iff there were any. */
+    bool PopDue(usec_t now, std::vector<Event> &due);
+
+  private:
+    static const uint64_t SLOTS = 256; // ticks covered by the wheel
+
+    usec_t tick; ///< length of a wheel bucket; 0 if the wheel is not in use
+    uint64_t base; ///< number of the earliest tick not yet drained
+    std::vector<std::vector<Event> > wheel; ///< tick n is in bucket n % SLOTS
+    size_t wheel_count; ///< number of events in the wheel
+    std::priority_queue<Event> heap; ///< events that don't fit in the wheel
+  };
 
   /** Queue of pending simulation events for the main thread to handle. */
+  std::vector<EventQueue> event_queues;
+
+  /** Due events being run by the main thread */
+  std::vector<Event> main_events;
+
+  /** Queue of models whose update callbacks are to be called by the
+      main thread, one for each thread. */
   std::vector<std::queue<Model *> > pending_update_callbacks;
 
+  /** Events due in the current update that are run by the worker
+      threads. Each worker starts on its own contiguous range of
+      these and, once that is done, steals from the back of the others'
+      ranges, so no thread idles while another has work left. */
+  std::vector<Event> due_events;
+
+  class WorkRange {
+  public:
+    WorkRange() : begin(0), end(0), mutex() { pthread_mutex_init(&mutex, NULL); }
+    ~WorkRange() { pthread_mutex_destroy(&mutex); }
+    size_t begin, end; ///< indices into due_events not yet taken
+    pthread_mutex_t mutex;
+  private:
+    WorkRange(const WorkRange &); // not copyable: holds a mutex
+  };
+
+  /** The range of due_events owned by each worker thread. */
+  std::vector<WorkRange *> work_ranges;
+
+  /** Events enqueued by each worker thread while the workers are
+      running, with their queue numbers. The main thread moves them
+      into event_queues when the workers are done. */
+  std::vector<std::vector<std::pair<unsigned int, Event> > > deferred_events;
+
   /** Create a new simulation event to be handled in the future.
 
 @param queue_num Specify which queue the event should be on. The main
@@ -1004,7 +1507,21 @@ called at the specified time.
   */
   void Enqueue(unsigned int queue_num, usec_t delay, Model *mod, model_callback_t cb, void *arg)
   {
-    event_queues[queue_num].push(Event(sim_time + delay, mod, cb, arg));
+    const Event ev(sim_time + delay, mod, cb, arg);
+    const unsigned int thread(CurrentThread());
+
+    // worker threads must not touch the shared queues
+    if (thread == 0)
+      event_queues[queue_num].Push(ev);
+    else
+      deferred_events[thread].push_back(std::make_pair(queue_num, ev));
+  }
+
+  /** Returns the index of the calling thread: 0 for the main thread,
+      1 to worker_threads for the workers. */
+  static unsigned int CurrentThread()
+  {
+    return static_cast<unsigned int>(reinterpret_cast<uintptr_t>(pthread_getspecific(thread_key)));
   }
 
   /** Set of models that require energy calculations at each World::Update(). */
@@ -1025,6 +1542,36 @@ called at the specified time.
   /** consume events from the queue up to and including the current sim_time */
   void ConsumeQueue(unsigned int queue_num);
 
+  /** Move the events due by the current sim_time from the worker
+      queues into due_events and split them between the workers.
+      Returns true iff there is any work to do. */
+  bool ShareDueEvents();
+
+  /** Take the next chunk of due_events for a worker to run, from its
+      own range if possible or else stolen from another's. Returns
+      false when there is nothing left. */
+  bool TakeWork(unsigned int worker, size_t &begin, size_t &end);
+
+  /** Run due events in a worker thread until there are none left */
+  void RunWork(unsigned int worker);
+
+  /** Robots to be moved by the worker threads, in groups that can't
+      affect each other. Each group is listed in the order the main
+      thread would move them, so the result is the same. */
+  std::vector<std::vector<ModelPosition *> > move_groups;
+
+  /** Split the moving robots in active_velocity into move_groups, by
+      the parts of the world their moves touch */
+  void GroupMoves();
+  /** Event callback that moves a group of robots in order */
+  static int MoveGroup(Model *, void *group);
+
+  /** Unblock the worker threads to run the shared due_events */
+  void StartWorkers();
+  /** Block until all the worker threads have finished, then queue
+      the events they created */
+  void WaitForWorkers();
+
   /** returns an event queue index number for a model to use for
 updates */
   unsigned int GetEventQueue(Model *mod) const;
@@ -1116,6 +1663,18 @@ nonexistent */
   const bounds3d_t &GetExtent() const { return extent; }
   /** Return the number of times the world has been updated. */
   uint64_t GetUpdateCount() const { return updates; }
+  /** Returns true iff the world is run so that its results don't
+      depend on the number of worker threads */
+  bool Deterministic() const { return deterministic; }
+  /** Returns the seed of the models' random number streams */
+  uint32_t RandomSeed() const { return random_seed; }
+  /** Returns the directory in which the polygons vectorized from
+      bitmap images are cached, or an empty string if they are not */
+  const std::string &BitmapCache() const { return bitmap_cache; }
+  /** Return the total time in seconds that worker thread t (counting
+      from 1) has spent running events. Similar values for all the
+      threads show the load is balanced. */
+  double GetWorkerBusyTime(unsigned int t) const { return worker_busy[t - 1]; }
   /// Register an Option for pickup by the GUI
   void RegisterOption(Option *opt);
 
@@ -1125,6 +1684,56 @@ nonexistent */
   Model *GetGround() { return ground; }
 };
 
+/** The occupancy grid has two layers for models that move, used
+    alternately by successive updates so that sensors can read one
+    while models move in the other, and one shared layer for models
+    that never move, so that they are rasterized only once. */
+const unsigned int STATIC_LAYER(2);
+const unsigned int LAYER_COUNT(3);
+
+/** The shape of a block: a polygon in its model's coordinates and
+    its extent in z. */
+class BlockShape {
+public:
+  std::vector<point_t> pts; ///< points defining a polygon.
+  Bounds local_z; ///<  z extent in local coords.
+
+  BlockShape() : pts(), local_z() {}
+  BlockShape(const std::vector<point_t> &pts, const Bounds &local_z) : pts(pts), local_z(local_z)
+  {
+  }
+
+  /** Read the shape from a worldfile block entity */
+  void Load(Worldfile *wf, int entity);
+
+  bool operator==(const BlockShape &other) const
+  {
+    return pts == other.pts && local_z.min == other.local_z.min
+           && local_z.max == other.local_z.max;
+  }
+};
+
+/** The shapes of the blocks in a BlockGroup, scaled to fit its
+    model, and the OpenGL display list that draws them. Models loaded
+    from the same definition have identical geometry, and after
+    loading World::ShareGeometry() makes them share one of these, so
+    a swarm of identical robots keeps a single copy. A geometry is
+    reference counted and must not be changed while it is shared: see
+    BlockGroup::Unshare(). */
+class BlockGeometry {
+public:
+  std::vector<BlockShape> shapes; ///< one for each block in the group
+  int displaylist; ///< draws the shapes, or 0 if not yet built
+  bool dirty; ///< iff true, the display list no longer matches the shapes
+  unsigned int refs; ///< the number of groups using this geometry
+
+  BlockGeometry() : shapes(), displaylist(0), dirty(true), refs(1) {}
+  ~BlockGeometry();
+
+  /** Returns a hash of the shapes, for finding identical geometry */
+  uint64_t Hash() const;
+};
+
 class Block {
   friend class BlockGroup;
   friend class Model;
@@ -1135,12 +1744,9 @@ class Block {
 
 public:
   /** Block Constructor. A model's body is a list of these
-blocks. The point data is copied, so pts can safely be freed
-after constructing the block.*/
-  Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &zrange);
-
-  /** A from-file  constructor */
-  Block(BlockGroup *group, Worldfile *wf, int entity);
+blocks. The block's shape is the index'th in its group's
+geometry.*/
+  Block(BlockGroup *group, unsigned int index);
 
   ~Block();
 
@@ -1150,6 +1756,11 @@ after constructing the block.*/
   /** remove the block from the world's raytracing data structure */
   void UnMap(unsigned int layer);
 
+  /** move the block to its current pose in the world's raytracing
+data structure, touching only the cells that have changed. Does
+nothing if the block's footprint in pixels has not changed. */
+  void ReMap(unsigned int layer);
+
   /** draw the block in OpenGL as a solid single color */
   void DrawSolid(bool topview);
 
@@ -1182,21 +1793,44 @@ after constructing the block.*/
   /** Returns the first model that shares a bitmap cell with this model */
   Model *TestCollision();
 
-  void Load(Worldfile *wf, int entity);
-
   void Rasterize(uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
                  meters_t cellheight);
 
   BlockGroup *group; ///< The BlockGroup to which this Block belongs.
+
+  /** The shape of this block, which may be shared with blocks of
+      other models */
+  inline const BlockShape &Shape() const;
+
 private:
-  std::vector<point_t> pts; ///< points defining a polygon.
-  Bounds local_z; ///<  z extent in local coords.
+  unsigned int index; ///< the index of the block's shape in the group's geometry
   Bounds global_z; ///< z extent in global coordinates.
 
   /** record the cells into which this block has been rendered so we
-can remove them very quickly. One vector for each of the two
-bitmap layers.*/
-  std::vector<Cell *> rendered_cells[2];
+can remove them very quickly. One vector for each of the bitmap
+layers, kept sorted so that ReMap() can compare it with the cells of
+the new pose.*/
+  std::vector<Cell *> rendered_cells[LAYER_COUNT];
+
+  /** the polygon in pixel coordinates that was rendered into each
+layer, so that ReMap() can tell when nothing has changed */
+  std::vector<point_int_t> rendered_pts[LAYER_COUNT];
+
+  /** update global_z for the model's current pose */
+  void UpdateGlobalZ();
+
+  /** The shape of this block, to be changed. The group is given a
+      geometry of its own first if it is shared. */
+  BlockShape &MutableShape();
+
+  /** Map() in two halves. The first finds the block's vertices in
+global pixels and the cells its edges pass through without touching
+the world, so it can be run on many blocks at once. Once the world has
+added the block to the cells of those pixels, the second records the
+vertices and the cells, which must be sorted. */
+  void PrepareMap(std::vector<point_int_t> &pts, std::vector<point_int_t> &pixels) const;
+  void FinishMap(unsigned int layer, const std::vector<point_int_t> &pts,
+                 const std::vector<Cell *> &cells);
 
   void DrawTop();
   void DrawSides();
@@ -1210,13 +1844,23 @@ class BlockGroup {
 
 private:
   std::vector<Block> blocks; ///< Contains the blocks in this group.
-  int displaylist; ///< OpenGL displaylist that renders this blockgroup.
+  BlockGeometry *geometry; ///< The shapes of the blocks, possibly shared.
 
 public:
   Model &mod;
 
 private:
-  void AppendBlock(const Block &block);
+  /** Add a block with the given shape to the group */
+  void AppendBlock(const BlockShape &shape);
+
+  /** Give this group a geometry of its own, copying the shared one,
+      so that it can be changed. Does nothing if the geometry is not
+      shared. */
+  void Unshare();
+
+  /** Use geom, which has identical shapes, in place of this group's
+      own geometry */
+  void Share(BlockGeometry *geom);
 
   void CalcSize();
   void Clear(); /** deletes all blocks from the group */
@@ -1231,11 +1875,32 @@ with a block in this group, or NULL, if none are detected. */
   void Map(unsigned int layer);
   /** Removes all blocks from the bitmap at the indicated layer.*/
   void UnMap(unsigned int layer);
+  /** Moves all blocks to their current pose in the bitmap at the
+indicated layer, touching only the cells that changed.*/
+  void ReMap(unsigned int layer);
+  /** Map() in two halves, one block at a time: see Block::PrepareMap() */
+  void PrepareMap(std::vector<std::vector<point_int_t> > &pts,
+                  std::vector<std::vector<point_int_t> > &pixels) const;
+  void FinishMap(unsigned int layer, const std::vector<std::vector<point_int_t> > &pts,
+                 const std::vector<std::vector<Cell *> > &cells);
 
   /** Interpret the bitmap file as a set of rectangles and add them
 as blocks to this group.*/
   void LoadBitmap(const std::string &bitmapfile, Worldfile *wf);
 
+  /** LoadBitmap() in two halves, so that loading can vectorize many
+bitmaps in parallel. VectorizeBitmap() finds the polygons in the file,
+or in the bitmap cache, and touches nothing else. Returns false if the
+file could not be read. AppendBitmap() adds the polygons as blocks. */
+  bool VectorizeBitmap(const std::string &bitmapfile, Worldfile *wf,
+                       std::vector<std::vector<point_t> > &polys, bool &cached) const;
+  void AppendBitmap(const std::string &bitmapfile,
+                    const std::vector<std::vector<point_t> > &polys, bool cached);
+
+  /** A bitmap named while the world is loading, to be added by
+AppendBitmap() once the world has vectorized it. Empty if none. */
+  std::string pending_bitmap;
+
   /** Add a new block decribed by a worldfile entry. */
   void LoadBlock(Worldfile *wf, int entity);
 
@@ -1246,12 +1911,13 @@ as blocks to this group.*/
   /** Draw the block in OpenGL as a solid single color. */
   void DrawSolid(const Geom &geom);
 
-  /** Re-create the display list for drawing this blockgroup. This
-is required whenever a member block or the owning model
-changes its appearance.*/
+  /** Re-create the display list for drawing this blockgroup's
+geometry. The list holds only the shapes, so that models that share
+the geometry can draw it in their own pose and color.*/
   void BuildDisplayList();
 
-  /** Draw the blockgroup from the cached displaylist. */
+  /** Draw the blockgroup from the cached displaylist, rebuilding it
+first if a member block has changed. */
   void CallDisplayList();
 
 public:
@@ -1268,6 +1934,11 @@ public:
   void DrawFootPrint(const Geom &geom);
 };
 
+inline const BlockShape &Block::Shape() const
+{
+  return group->geometry->shapes[index];
+}
+
 class Camera {
 protected:
   double _pitch; // left-right (about y)
@@ -1669,6 +2340,14 @@ private:
   /** records if this model has been mapped into the world bitmap*/
   bool mapped;
 
+  /** If true, the model's blocks are mapped into the world's static
+layer instead of the two layers used by moving models. */
+  bool static_map;
+
+  /** Set when SetPose() moves a model out of the static layer, so it
+and its descendents are never mapped there again. */
+  bool repositioned;
+
   std::vector<Option *> drawOptions;
   const std::vector<Option *> &getOptions() const { return drawOptions; }
 protected:
@@ -1792,6 +2471,10 @@ offset of its local coordinate system wrt that its parent. */
 
   /** unique process-wide identifier for this model */
   uint32_t id;
+  RandomStream rng; ///< this model's random numbers, keyed by random_seed and id
+
+  /** order models by id */
+  static bool IdLess(const Model *a, const Model *b) { return a->id < b->id; }
   usec_t interval; ///< time between updates in usec
   usec_t interval_energy; ///< time between updates of powerpack in usec
   usec_t last_update; ///< time of last update in us
@@ -1802,10 +2485,38 @@ offset of its local coordinate system wrt that its parent. */
   /** Pointer to the parent of this model, possibly NULL. */
   Model *parent;
 
+  /** The root of the tree containing this model, and this model's
+interval in a depth-first numbering of that tree: the descendents of
+this model are exactly the models in the same tree whose tree_pre
+lies in [tree_pre, tree_post]. These make IsRelated() and friends a
+few comparisons. Kept up to date by LabelTree(). */
+  Model *root;
+  uint32_t tree_pre, tree_post;
+
+  /** Recompute root and tree labels for this model and all its
+descendents, numbering from counter. Call it on a root model
+whenever the shape of its tree changes. */
+  void LabelTree(Model *root, uint32_t &counter);
+
   /** The pose of the model in it's parents coordinate frame, or the
 global coordinate frame is the parent is NULL. */
   Pose pose;
 
+  /** Cache of the model's global pose, and of the global pose of its
+geometric origin (global_pose + geom.pose), with the cosine and sine
+of their headings. Kept up to date by UpdateGlobalPose(), so that
+GetGlobalPose() and the coordinate transforms need no recursion or
+trig. */
+  Pose global_pose;
+  double global_cosa, global_sina;
+  Pose global_origin;
+  double origin_cosa, origin_sina;
+
+  /** Recompute the cached global pose of this model and all its
+descendents. Call this whenever pose, geom, parent or
+stack_children change. */
+  void UpdateGlobalPose();
+
   /** Optional attached PowerPack, defaults to NULL */
   PowerPack *power_pack;
 
@@ -1837,7 +2548,6 @@ initially NULL. */
 
   } rastervis;
 
-  bool rebuild_displaylist; ///< iff true, regenerate block display list before redraw
   std::string say_string; ///< if non-empty, this string is displayed in the GUI
 
   bool stack_children; ///< whether child models should be stacked on top of this model or not
@@ -1991,6 +2701,47 @@ calls TestCollision() on all descendents. */
   void MapWithChildren(unsigned int layer);
   void UnMapWithChildren(unsigned int layer);
 
+  /** Update the model's mapping after a move, touching only the
+cells whose occupancy changed. Equivalent to UnMap() then Map(). */
+  void ReMap(unsigned int layer);
+  void ReMapWithChildren(unsigned int layer);
+
+  /** Extend the bounds (in meters) to cover every cell this model
+and its descendents are rendered into in the layer, and any they
+could be rendered into after moving up to dxy meters and turning up
+to da radians about centre. */
+  void SweptExtent(unsigned int layer, const point_t &centre, meters_t dxy, radians_t da,
+                   Bounds &x, Bounds &y) const;
+
+  /** Returns true iff neither this model nor any of its ancestors
+can move itself or has been moved by SetPose() since loading, so it
+can be mapped into the static layer. */
+  bool Stationary() const;
+
+  /** Choose the layers this model and its descendents are mapped
+into. They must be unmapped when this is called. */
+  void SetStaticMapWithChildren();
+
+  /** Move this model and its descendents to a new parent (or to the
+top level if newparent is NULL), keeping its local pose. Unmaps the
+subtree, relinks and relabels both trees, then updates the global
+poses and layers and maps it again. */
+  void Reparent(Model *newparent);
+
+  /** Map() in two halves, so that loading can map many models in
+parallel. PrepareMap() finds the cells each block will be rendered
+into and doesn't touch the world. Once the world has rendered the
+blocks into those cells in MapLayers(), FinishMap() records the cells
+of each block in those layers. */
+  void PrepareMap(std::vector<std::vector<point_int_t> > &pts,
+                  std::vector<std::vector<point_int_t> > &pixels) const;
+  void FinishMap(const std::vector<std::vector<point_int_t> > &pts,
+                 const std::vector<std::vector<Cell *> > &cells);
+
+  /** Fill layers with the layers Map() renders this model into, and
+return how many there are */
+  unsigned int MapLayers(unsigned int layers[2]) const;
+
   /// Find the root model, and map/unmap the whole tree.
   void MapFromRoot(unsigned int layer);
   void UnMapFromRoot(unsigned int layer);
@@ -2012,6 +2763,24 @@ by pose, in local coords */
     return world->Raytrace(LocalToGlobal(pose), range, fov, func, this, arg, ztest, results);
   }
 
+  /** raytraces a single ray from the point and heading identified by
+pose, in local coords, testing blocks with the functor pred */
+  template <class Pred>
+  RaytraceResult Raytrace(const Pose &pose, const meters_t range, const Pred &pred,
+                          const bool ztest)
+  {
+    return world->Raytrace(Ray(this, LocalToGlobal(pose), range, NULL, NULL, ztest), pred);
+  }
+
+  /** raytraces multiple rays around the point and heading identified
+by pose, in local coords, testing blocks with the functor pred */
+  template <class Pred>
+  void Raytrace(const Pose &pose, const meters_t range, const radians_t fov, const Pred &pred,
+                const bool ztest, std::vector<RaytraceResult> &results)
+  {
+    world->Raytrace(LocalToGlobal(pose), range, fov, pred, this, ztest, results);
+  }
+
   virtual void UpdateCharge();
 
   static int UpdateWrapper(Model *mod, void *)
@@ -2098,10 +2867,11 @@ public:
 
   /** Alternate constructor that creates dummy models with only a pose */
   Model()
-      : mapped(false), alwayson(false), blockgroup(*this), boundary(false), data_fresh(false),
+      : mapped(false), static_map(false), repositioned(false), alwayson(false), blockgroup(*this), boundary(false), data_fresh(false),
         disabled(true), friction(0), has_default_block(false), id(0), interval(0),
         interval_energy(0), last_update(0), log_state(false), map_resolution(0), mass(0),
-        parent(NULL), power_pack(NULL), rebuild_displaylist(false), stack_children(true),
+        parent(NULL), root(this), tree_pre(0), tree_post(0), global_cosa(1), global_sina(0), origin_cosa(1), origin_sina(0),
+        power_pack(NULL), stack_children(true),
         stall(false), subs(0), thread_safe(false), trail_index(0), event_queue_num(0), used(false),
         watts(0), watts_give(0), watts_take(0), wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
   {
@@ -2178,6 +2948,10 @@ entity */
 dz] */
   void AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meters_t dz);
 
+  /** If the model has a boundary, add a thin block along each edge of
+its bounding box */
+  void AddBoundaryBlocks();
+
   /** remove all blocks from this model, freeing their memory */
   void ClearBlocks();
 
@@ -2186,15 +2960,29 @@ model has no parent */
   Model *Parent() const { return this->parent; }
   /** Returns a pointer to the world that contains this model */
   World *GetWorld() const { return this->world; }
+  /** Returns this model's own stream of random numbers. It is keyed
+by the world's random_seed and the model's id, so it gives the same
+numbers in every run of a world, whichever thread updates the
+model. */
+  RandomStream &Random() { return rng; }
   /** return the root model of the tree containing this model */
-  Model *Root() { return (parent ? parent->Root() : this); }
-  bool IsAntecedent(const Model *testmod) const;
+  Model *Root() { return root; }
+  /** returns true if model [testmod] is an antecedent of this model */
+  bool IsAntecedent(const Model *testmod) const
+  {
+    return (testmod != this) && testmod->IsDescendent(this);
+  }
 
   /** returns true if model [testmod] is a descendent of this model */
-  bool IsDescendent(const Model *testmod) const;
+  bool IsDescendent(const Model *testmod) const
+  {
+    return (testmod->root == root) && (tree_pre <= testmod->tree_pre)
+           && (testmod->tree_pre <= tree_post);
+  }
 
-  /** returns true if model [testmod] is a descendent or antecedent of this model */
-  bool IsRelated(const Model *testmod) const;
+  /** returns true if model [testmod] is in the same tree as this
+model, i.e. it is this model or shares an antecedent with it */
+  bool IsRelated(const Model *testmod) const { return testmod->root == root; }
 
   /** get the pose of a model in the global CS */
   Pose GetGlobalPose() const;
@@ -2293,9 +3081,16 @@ coordinate system. */
 
   /** Return the global pose (i.e. pose in world coordinates) of a
 pose specified in the model's local coordinate system */
-  Pose LocalToGlobal(const Pose &pose) const { return ((GetGlobalPose() + geom.pose) + pose); }
+  Pose LocalToGlobal(const Pose &pose) const
+  {
+    return Pose(global_origin.x + pose.x * origin_cosa - pose.y * origin_sina,
+                global_origin.y + pose.x * origin_sina + pose.y * origin_cosa,
+                global_origin.z + pose.z, normalize(global_origin.a + pose.a));
+  }
   /** Return a vector of global pixels corresponding to a vector of local points. */
   std::vector<point_int_t> LocalToPixels(const std::vector<point_t> &local) const;
+  /** As above, filling global, which may be a reused buffer. */
+  void LocalToPixels(const std::vector<point_t> &local, std::vector<point_int_t> &global) const;
 
   /** Return the 2d point in world coordinates of a 2d point
 specified in the model's local coordinate system */
@@ -2325,6 +3120,38 @@ protected:
   virtual void Update();
 };
 
+// RAY PREDICATES ----------------------------------------------------------
+
+/** Ray predicate that stops at any model not related to the finder */
+class RayMatchUnrelated {
+public:
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return !finder->IsRelated(candidate);
+  }
+};
+
+/** Ray predicate for rangers: ignores the finder's own tree and
+models that are invisible to rangers */
+class RayMatchRanger {
+public:
+  bool operator()(Model *hit, const Model *finder) const
+  {
+    return (!hit->IsRelated(finder)) && (sgn(hit->vis.ranger_return) != -1);
+  }
+};
+
+/** Ray predicate for grippers: stops at anything grippable except
+the finder itself. The usual relation check can't be used, because
+we may pick things up and we must still see them. */
+class RayMatchGripper {
+public:
+  bool operator()(Model *hit, const Model *finder) const
+  {
+    return (hit != finder) && hit->vis.gripper_return;
+  }
+};
+
 // BLOBFINDER MODEL --------------------------------------------------------
 /// %ModelBlobfinder class
 class ModelBlobfinder : public Model {
@@ -2644,10 +3471,18 @@ public:
     std::vector<double> intensities;
     std::vector<double> bearings;
 
+    /** ray headings and results for tracing a scan as a fan. Kept
+  here to avoid reallocating them at every update. */
+    std::vector<radians_t> headings;
+    std::vector<RaytraceResult> samples;
+    /** noise for a whole scan, drawn in batches */
+    std::vector<double> uniform_noise, gaussian_noise;
+
     Sensor()
         : pose(0, 0, 0, 0), size(0.02, 0.02, 0.02), // teeny transducer
           range(0.0, 5.0), fov(0.1), angle_noise(0.0), range_noise(0.0), range_noise_const(0.0),
-          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings()
+          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings(),
+          headings(), samples(), uniform_noise(), gaussian_noise()
     {
     }
 
@@ -2880,6 +3715,10 @@ a (radians per second squared) */
 
 protected:
   virtual void Move();
+  /** Set the bounds (in meters) of every cell Move() could read or
+      change in this update's layer. Returns false if Move() would do
+      nothing. */
+  bool MoveExtent(unsigned int layer, Bounds &x, Bounds &y) const;
   virtual void Startup();
   virtual void Shutdown();
   virtual void Update();
@@ -24,6 +24,9 @@
     show_clock                0
     show_clock_interval     100
     threads                   1
+    deterministic             0
+    random_seed          <time>
+    bitmap_cache             ""
 
     @endverbatim
 
@@ -69,7 +72,32 @@
     worldfile. As a guideline, use one thread per core if you have
     parallel-enabled high-resolution models, e.g. a laser with
     hundreds or thousands of samples, or lots of models. Defaults to
-    1. Values of less than 1 will be forced to 1.
+    1. Values of less than 1 will be forced to 1. The models due for
+    update are shared out between the threads at every update, with
+    idle threads taking work from busy ones. With 2 or more threads,
+    position models are moved in parallel too, with the same results
+    as moving them one by one. If show_clock is enabled
+    the time each thread has spent busy is printed with the clock.
+
+    - deterministic <int>\n
+    If non-zero, run the world so that its results are the same in
+    every run and for any number of threads: each model draws its
+    random numbers from its own stream (see Model::Random()), the
+    sensors finish before any model moves, and update callbacks are
+    called in order of model id. Defaults to 0.
+
+    - random_seed <int>\n
+    The seed of the models' random number streams. Defaults to 0 if
+    deterministic is set, or otherwise the time Stage started.
+
+    - bitmap_cache <string>\n
+    A directory in which to keep the polygons vectorized from each
+    model's bitmap image, so that later runs can skip decoding and
+    tracing the image. Relative paths are taken from the worldfile's
+    directory, so "." keeps the cache next to the world. Entries are
+    keyed by the contents of the image, so edited images are traced
+    again. The directory must already exist. Defaults to "", which
+    disables the cache.
 
     @par More examples
     The Stage source distribution contains several example world files in
@@ -99,20 +127,13 @@ using std::abs;
 #include "worldfile.hh"
 using namespace Stg;
 
-// // function objects for comparing model positions
-bool World::ltx::operator()(const Model *a, const Model *b) const
-{
-  const meters_t ax(a->GetGlobalPose().x);
-  const meters_t bx(b->GetGlobalPose().x);
-  // break ties using the pointer value to give a unique ordering
-  return (ax == bx ? a < b : ax < bx);
-}
-bool World::lty::operator()(const Model *a, const Model *b) const
+
+// wall clock time in seconds, for timing the phases of loading
+static double seconds_now()
 {
-  const meters_t ay(a->GetGlobalPose().y);
-  const meters_t by(b->GetGlobalPose().y);
-  // break ties using the pointer value ro give a unique ordering
-  return (ay == by ? a < b : ay < by);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
 // static data members
@@ -126,20 +147,22 @@ World::World(const std::string &,
              double ppm)
     : // private
       destroy(false),
-      dirty(true), models(), models_by_name(), models_with_fiducials(), models_with_fiducials_byx(),
-      models_with_fiducials_byy(), ppm(ppm), // raytrace resolution
-      quit(false), show_clock(false),
+      dirty(true), models(), models_by_name(), models_with_fiducials(),
+      fiducial_index(2.0), moved_fiducials(1), ppm(ppm), // raytrace resolution
+      quit(false), show_clock(false), deterministic(false), random_seed(time(NULL)),
+      bitmap_cache(),
       show_clock_interval(100), // 10 simulated seconds using defaults
       sync_mutex(), threads_working(0), threads_start_cond(), threads_done_cond(), total_subs(0),
-      worker_threads(1),
+      worker_threads(1), worker_busy(), load_started(0), loading(false),
 
       // protected
       cb_list(), extent(), graphics(false), option_table(), powerpack_list(), quit_time(0),
-      ray_list(), sim_time(0), superregions(), updates(0), wf(NULL), paused(false),
+      ray_records(1), map_scratch(1), sim_time(0), superregions(), updates(0), wf(NULL), paused(false),
       event_queues(1), // use 1 thread by default
-      pending_update_callbacks(), active_energy(), active_velocity(),
+      main_events(), pending_update_callbacks(), due_events(), work_ranges(), deferred_events(),
+      active_energy(), active_velocity(),
       sim_interval(1e5), // 100 msec has proved a good default
-      update_cb_count(0)
+      update_cb_count(0), move_groups()
 {
   if (!Stg::InitDone()) {
     PRINT_WARN("Stg::Init() must be called before a World is created.");
@@ -150,6 +173,9 @@ World::World(const std::string &,
   pthread_cond_init(&threads_start_cond, NULL);
   pthread_cond_init(&threads_done_cond, NULL);
 
+  static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+  pthread_once(&thread_key_once, World::CreateThreadKey);
+
   World::world_set.insert(this);
 
   ground = new Model(this, NULL, "model");
@@ -167,23 +193,265 @@ World::~World(void)
     delete ground;
   if (wf)
     delete wf;
+  FOR_EACH (it, work_ranges)
+    delete *it;
   World::world_set.erase(this);
 }
 
+pthread_key_t World::thread_key;
+
+const size_t SuperRegionIndex::MIN_SLOTS;
+const size_t RayRecord::CAPACITY;
+
+SpatialHash::SpatialHash(meters_t cell_size, size_t bucket_count)
+    : cell_size(cell_size), buckets(), members(), positions(), lo(), hi()
+{
+  // round up to a power of two so a mask picks the bucket
+  size_t size(1);
+  while (size < bucket_count)
+    size *= 2;
+  buckets.resize(size);
+}
+
+point_int_t SpatialHash::CellOf(const Model *mod) const
+{
+  const Pose &gpose(mod->GetGlobalPose());
+  return point_int_t(floor(gpose.x / cell_size), floor(gpose.y / cell_size));
+}
+
+void SpatialHash::Cover(const point_int_t &cell)
+{
+  if (members.size() == 1) {
+    lo = hi = cell;
+    return;
+  }
+
+  lo.x = std::min(lo.x, cell.x);
+  lo.y = std::min(lo.y, cell.y);
+  hi.x = std::max(hi.x, cell.x);
+  hi.y = std::max(hi.y, cell.y);
+}
+
+void SpatialHash::Insert(Model *mod)
+{
+  const Entry entry(mod, CellOf(mod));
+  positions[mod] = members.size();
+  members.push_back(entry);
+  Bucket(entry.cell).push_back(entry);
+  Cover(entry.cell);
+}
+
+void SpatialHash::Unfile(Model *mod, const point_int_t &cell)
+{
+  std::vector<Entry> &bucket(Bucket(cell));
+  for (size_t i(0); i < bucket.size(); ++i)
+    if (bucket[i].mod == mod) {
+      bucket[i] = bucket.back();
+      bucket.pop_back();
+      return;
+    }
+}
+
+void SpatialHash::Erase(Model *mod)
+{
+  std::map<Model *, size_t>::iterator pos(positions.find(mod));
+  if (pos == positions.end())
+    return;
+
+  const size_t i(pos->second);
+  positions.erase(pos);
+  Unfile(mod, members[i].cell);
+
+  // keep the order of the others, so queries find them in the same
+  // order from run to run
+  members.erase(members.begin() + i);
+  for (size_t j(i); j < members.size(); ++j)
+    positions[members[j].mod] = j;
+
+  // the extent may have shrunk
+  for (size_t j(0); j < members.size(); ++j)
+    if (j == 0)
+      lo = hi = members[j].cell;
+    else
+      Cover(members[j].cell);
+}
+
+void SpatialHash::Move(Model *mod)
+{
+  std::map<Model *, size_t>::const_iterator pos(positions.find(mod));
+  if (pos == positions.end())
+    return;
+
+  Entry &entry(members[pos->second]);
+  const point_int_t cell(CellOf(mod));
+  if (!(cell == entry.cell)) {
+    Unfile(mod, entry.cell);
+    entry.cell = cell;
+    Bucket(cell).push_back(entry);
+    Cover(cell);
+  }
+}
+
+void SpatialHash::Query(const point_t &centre, meters_t radius,
+                        std::vector<Model *> &found) const
+{
+  if (members.empty())
+    return;
+
+  const int32_t x0(std::max<int32_t>(lo.x, floor((centre.x - radius) / cell_size)));
+  const int32_t x1(std::min<int32_t>(hi.x, floor((centre.x + radius) / cell_size)));
+  const int32_t y0(std::max<int32_t>(lo.y, floor((centre.y - radius) / cell_size)));
+  const int32_t y1(std::min<int32_t>(hi.y, floor((centre.y + radius) / cell_size)));
+
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  // a long range in a sparse world covers more cells than there are
+  // models, so testing every model is cheaper
+  if ((double)(x1 - x0 + 1) * (y1 - y0 + 1) > members.size()) {
+    FOR_EACH (it, members) {
+      const Pose &gpose(it->mod->GetGlobalPose());
+      if (hypot(gpose.x - centre.x, gpose.y - centre.y) <= radius)
+        found.push_back(it->mod);
+    }
+    return;
+  }
+
+  for (int32_t y(y0); y <= y1; ++y)
+    for (int32_t x(x0); x <= x1; ++x) {
+      const point_int_t cell(x, y);
+      const std::vector<Entry> &bucket(Bucket(cell));
+
+      // other cells may share the bucket
+      FOR_EACH (it, bucket)
+        if (it->cell == cell) {
+          const Pose &gpose(it->mod->GetGlobalPose());
+          if (hypot(gpose.x - centre.x, gpose.y - centre.y) <= radius)
+            found.push_back(it->mod);
+        }
+    }
+}
+
+SuperRegionIndex::~SuperRegionIndex()
+{
+  Reclaim();
+  delete slots;
+}
+
+void SuperRegionIndex::Insert(const point_int_t &org, SuperRegion *sr)
+{
+  assert(sr);
+
+  // keep the table at most half full so probe sequences stay short
+  if (2 * (all.size() + 1) > slots->size())
+    Grow();
+
+  std::vector<Slot> &table(*slots);
+  const size_t mask(table.size() - 1);
+  size_t i(Hash(org) & mask);
+  while (table[i].sr)
+    i = (i + 1) & mask;
+
+  // readers stop at an empty slot, so fill in the key first
+  table[i].org = org;
+  __sync_synchronize();
+  table[i].sr = sr;
+  all.push_back(sr);
+}
+
+void SuperRegionIndex::Erase(const point_int_t &org)
+{
+  // entries are shifted in place, which concurrent readers could
+  // miss, so the table is copied and published like a grown one
+  std::vector<Slot> *fresh(new std::vector<Slot>(*slots));
+  std::vector<Slot> &table(*fresh);
+
+  const size_t mask(table.size() - 1);
+  size_t i(Hash(org) & mask);
+  while (table[i].sr && !(table[i].org == org))
+    i = (i + 1) & mask;
+
+  if (table[i].sr == NULL) { // not found
+    delete fresh;
+    return;
+  }
+
+  EraseAll(table[i].sr, all);
+  table[i] = Slot();
+
+  // shift back any following entries of the probe run, so that Find()
+  // can keep stopping at the first empty slot
+  for (size_t j((i + 1) & mask); table[j].sr; j = (j + 1) & mask) {
+    const size_t home(Hash(table[j].org) & mask);
+
+    // move the entry into the hole unless its home lies cyclically
+    // in (i,j]
+    if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+      table[i] = table[j];
+      table[j] = Slot();
+      i = j;
+    }
+  }
+
+  Publish(fresh);
+}
+
+void SuperRegionIndex::Grow()
+{
+  const std::vector<Slot> &old(*slots);
+  std::vector<Slot> *fresh(new std::vector<Slot>(old.size() * 2));
+  std::vector<Slot> &table(*fresh);
+
+  const size_t mask(table.size() - 1);
+  FOR_EACH (it, old)
+    if (it->sr) {
+      size_t i(Hash(it->org) & mask);
+      while (table[i].sr)
+        i = (i + 1) & mask;
+      table[i] = *it;
+    }
+
+  Publish(fresh);
+}
+
+void SuperRegionIndex::Publish(std::vector<Slot> *table)
+{
+  // the new table must be complete before any reader can see it
+  __sync_synchronize();
+  std::vector<Slot> *old(slots);
+  retired.push_back(old);
+  slots = table;
+}
+
+void SuperRegionIndex::Reclaim()
+{
+  FOR_EACH (it, retired)
+    delete *it;
+  retired.clear();
+}
+
 SuperRegion *World::CreateSuperRegion(point_int_t origin)
 {
   SuperRegion *sr(new SuperRegion(this, origin));
-  superregions[origin] = sr;
+  superregions.Insert(origin, sr);
   dirty = true; // force redraw
   return sr;
 }
 
 void World::DestroySuperRegion(SuperRegion *sr)
 {
-  superregions.erase(sr->GetOrigin());
+  superregions.Erase(sr->GetOrigin());
   delete sr;
 }
 
+size_t World::OccupancyMemory() const
+{
+  size_t bytes(0);
+  FOR_EACH (it, superregions.All())
+    bytes += (*it)->MemoryUsage();
+  return bytes;
+}
+
 void World::Run()
 {
   // first check whether there is a single gui world
@@ -222,11 +490,179 @@ bool World::UpdateAll()
   return quit;
 }
 
+// orders pixels by superregion first, so that each block's pixels in
+// a superregion are contiguous
+static bool superregion_less(const point_int_t &a, const point_int_t &b)
+{
+  const int32_t ax(GETSREG(a.x)), bx(GETSREG(b.x));
+  if (ax != bx)
+    return ax < bx;
+
+  const int32_t ay(GETSREG(a.y)), by(GETSREG(b.y));
+  if (ay != by)
+    return ay < by;
+
+  return a < b;
+}
+
+World::LoadJob::LoadJob(World *world, const std::set<Model *> &mods)
+    : world(world), phase(VECTORIZE), models(mods.begin(), mods.end()), polys(mods.size()),
+      vectorized(mods.size(), 0), cached(mods.size(), 0), pts(mods.size()), pixels(mods.size()), shards(), spans(),
+      block_spans(mods.size()), next(0)
+{
+  // in the order they were loaded, so that they report in that order
+  std::sort(models.begin(), models.end(), Model::IdLess);
+}
+
+void World::LoadJob::Run(Phase p, unsigned int threads)
+{
+  phase = p;
+  next = 0;
+
+  std::vector<pthread_t> helpers(threads - 1);
+  FOR_EACH (it, helpers)
+    pthread_create(&*it, NULL, (void *(*)(void *))World::load_thread_entry, this);
+  load_thread_entry(this);
+  FOR_EACH (it, helpers)
+    pthread_join(*it, NULL);
+}
+
+void World::LoadJob::Shard()
+{
+  std::map<point_int_t, size_t> index; // of each superregion's shard
+
+  for (size_t m(0); m < models.size(); ++m) {
+    block_spans[m].resize(pixels[m].size());
+
+    for (size_t b(0); b < pixels[m].size(); ++b) {
+      const std::vector<point_int_t> &pix(pixels[m][b]);
+
+      for (size_t begin(0), end; begin < pix.size(); begin = end) {
+        const point_int_t sreg(GETSREG(pix[begin].x), GETSREG(pix[begin].y));
+        for (end = begin + 1;
+             end < pix.size() && GETSREG(pix[end].x) == sreg.x && GETSREG(pix[end].y) == sreg.y;
+             ++end)
+          ;
+
+        std::map<point_int_t, size_t>::iterator it(index.find(sreg));
+        if (it == index.end()) {
+          it = index.insert(std::make_pair(sreg, shards.size())).first;
+          shards.push_back(world->GetSuperRegionCreate(sreg));
+          spans.push_back(std::vector<Span>());
+        }
+
+        spans[it->second].push_back(Span(m, b, begin, end));
+        block_spans[m][b].push_back(std::make_pair(it->second, spans[it->second].size() - 1));
+      }
+    }
+  }
+}
+
+void *World::load_thread_entry(LoadJob *job)
+{
+  const size_t count(job->phase == LoadJob::MAP ? job->shards.size() : job->models.size());
+
+  size_t i;
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < count) {
+    switch (job->phase) {
+    case LoadJob::VECTORIZE: {
+      const BlockGroup &bg(job->models[i]->blockgroup);
+      bool cached(false);
+      if (!bg.pending_bitmap.empty())
+        job->vectorized[i] =
+            bg.VectorizeBitmap(bg.pending_bitmap, job->world->wf, job->polys[i], cached);
+      job->cached[i] = cached;
+    } break;
+
+    case LoadJob::RASTERIZE: {
+      Model *mod(job->models[i]);
+      mod->blockgroup.CalcSize();
+      mod->PrepareMap(job->pts[i], job->pixels[i]);
+      FOR_EACH (it, job->pixels[i])
+        std::sort(it->begin(), it->end(), superregion_less);
+    } break;
+
+    case LoadJob::MAP: {
+      // only this thread touches this superregion, so its regions
+      // and cells can be created and filled without locking
+      SuperRegion *sr(job->shards[i]);
+      FOR_EACH (it, job->spans[i]) {
+        Model *mod(job->models[it->model]);
+        Block *block(&mod->blockgroup.blocks[it->block]);
+        const std::vector<point_int_t> &pixels(job->pixels[it->model][it->block]);
+
+        unsigned int layers[2];
+        const unsigned int layer_count(mod->MapLayers(layers));
+
+        it->cells.reserve(it->end - it->begin);
+        for (size_t p(it->begin); p < it->end; ++p) {
+          const point_int_t &pix(pixels[p]);
+          // need to call Region::GetCell() before using a Cell pointer
+          // directly, because the region allocates cells lazily
+          Cell *cell(sr->GetRegion(GETREG(pix.x), GETREG(pix.y))
+                         ->GetCell(GETCELL(pix.x), GETCELL(pix.y)));
+          for (unsigned int l(0); l < layer_count; ++l)
+            cell->InsertBlock(block, layers[l]);
+          it->cells.push_back(cell);
+        }
+      }
+    } break;
+
+    case LoadJob::FINISH: {
+      std::vector<std::vector<Cell *> > cells(job->block_spans[i].size());
+      for (size_t b(0); b < cells.size(); ++b) {
+        FOR_EACH (it, job->block_spans[i][b]) {
+          const std::vector<Cell *> &found(job->spans[it->first][it->second].cells);
+          cells[b].insert(cells[b].end(), found.begin(), found.end());
+        }
+        std::sort(cells[b].begin(), cells[b].end());
+      }
+      job->models[i]->FinishMap(job->pts[i], cells); // both layers, or the static layer
+    } break;
+    }
+  }
+
+  return NULL;
+}
+
+size_t World::ShareGeometry()
+{
+  // geometries seen so far, by hash. Models loaded from the same
+  // definition will usually find theirs at the first try.
+  std::map<uint64_t, std::vector<BlockGeometry *> > seen;
+  size_t count(0);
+
+  FOR_EACH (it, models) {
+    BlockGroup &bg((*it)->blockgroup);
+    if (bg.geometry->shapes.empty())
+      continue;
+
+    std::vector<BlockGeometry *> &candidates(seen[bg.geometry->Hash()]);
+
+    bool shared(false);
+    FOR_EACH (cit, candidates)
+      if ((*cit)->shapes == bg.geometry->shapes) {
+        bg.Share(*cit);
+        shared = true;
+        break;
+      }
+
+    if (!shared) {
+      candidates.push_back(bg.geometry);
+      ++count;
+    }
+  }
+
+  return count;
+}
+
 void *World::update_thread_entry(std::pair<World *, int> *thread_info)
 {
   World *world(thread_info->first);
   const int thread_instance(thread_info->second);
 
+  pthread_setspecific(thread_key, reinterpret_cast<void *>(static_cast<intptr_t>(thread_instance)));
+
   // printf( "thread ID %d waiting for mutex\n", thread_instance );
 
   pthread_mutex_lock(&world->sync_mutex);
@@ -240,7 +676,7 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
     pthread_mutex_unlock(&world->sync_mutex);
 
     // printf( "worker %u thread awakes for task %u\n", thread_instance, task );
-    world->ConsumeQueue(thread_instance);
+    world->RunWork(thread_instance);
     // printf( "thread %d done\n", thread_instance );
 
     // done working, so increment the counter. If this was the last
@@ -275,6 +711,7 @@ void World::RemoveModel(Model *mod)
   models_by_name.erase(mod->token);
 
   models.erase(mod);
+  FiducialErase(mod);
 }
 
 void World::LoadBlock(Worldfile *wf, int entity)
@@ -360,6 +797,7 @@ bool World::Load(std::istream &world_content, const std::string &worldfile_path)
 
   printf(" [Loading from stream]");
   fflush(stdout);
+  load_started = seconds_now();
 
   this->wf = new Worldfile();
   if (!wf->Load(world_content, worldfile_path))
@@ -381,6 +819,7 @@ bool World::Load(const std::string &worldfile_path)
 
   printf(" [Loading %s]", worldfile_path.c_str());
   fflush(stdout);
+  load_started = seconds_now();
 
   this->wf = new Worldfile();
   if (!wf->Load(worldfile_path)) {
@@ -398,6 +837,8 @@ bool World::Load(const std::string &worldfile_path)
 
 void World::LoadWorldPostHook()
 {
+  const double parsed(seconds_now());
+
   this->quit_time = (usec_t)(million * wf->ReadFloat(0, "quit_time", this->quit_time));
 
   this->ppm = 1.0 / wf->ReadFloat(0, "resolution", 1.0 / this->ppm);
@@ -409,6 +850,19 @@ void World::LoadWorldPostHook()
   // read msec instead of usec: easier for user
   this->sim_interval = 1e3 * wf->ReadFloat(0, "interval_sim", this->sim_interval / 1e3);
 
+  // a deterministic world is seeded the same every time unless told
+  // otherwise
+  this->deterministic = wf->ReadInt(0, "deterministic", this->deterministic);
+  this->random_seed =
+      wf->ReadInt(0, "random_seed", this->deterministic ? 0 : this->random_seed);
+
+  // the global stream is still used by Pose::Random() and
+  // Color::RandomColor(), and by user code
+  if (this->deterministic)
+    srand48(this->random_seed);
+
+  this->bitmap_cache = wf->ReadString(0, "bitmap_cache", this->bitmap_cache);
+
   this->worker_threads = wf->ReadInt(0, "threads", this->worker_threads);
   if (this->worker_threads < 1) {
     PRINT_WARN("threads set to <1. Forcing to 1");
@@ -417,6 +871,19 @@ void World::LoadWorldPostHook()
 
   pending_update_callbacks.resize(worker_threads + 1);
   event_queues.resize(worker_threads + 1);
+  deferred_events.resize(worker_threads + 1);
+  moved_fiducials.resize(worker_threads + 1);
+  ray_records.resize(worker_threads + 1);
+  map_scratch.resize(worker_threads + 1);
+  FOR_EACH (it, event_queues)
+    it->SetTick(sim_interval, sim_time);
+  worker_busy.resize(worker_threads, 0.0);
+  // one range per worker, replacing any from an earlier load
+  FOR_EACH (it, work_ranges)
+    delete *it;
+  work_ranges.resize(worker_threads);
+  FOR_EACH (it, work_ranges)
+    *it = new WorkRange();
 
   // printf( "worker threads %d\n", worker_threads );
 
@@ -437,7 +904,11 @@ void World::LoadWorldPostHook()
   if (worker_threads > 1)
     printf("[threads %u]", worker_threads);
 
-  // Iterate through entitys and create objects of the appropriate type
+  // Iterate through entitys and create objects of the appropriate
+  // type. This stays in order and on this thread, since loading a
+  // model registers it with the world and its parent. Bitmaps are
+  // only noted here, to be vectorized together below.
+  loading = true;
   for (int entity(1); entity < wf->GetEntityCount(); ++entity) {
     const char *typestr = (char *)wf->GetEntityType(entity);
 
@@ -452,19 +923,67 @@ void World::LoadWorldPostHook()
       LoadModel(wf, entity);
   }
 
-  // call all controller init functions
+  const double created(seconds_now());
+
+  // the phases of loading share their work between as many threads
+  // as the world runs
+  LoadJob job(this, models);
+
+  // read the bitmaps in parallel, then add their blocks in order,
+  // since adding blocks changes the models
+  job.Run(LoadJob::VECTORIZE, worker_threads);
+  for (size_t i(0); i < job.models.size(); ++i) {
+    Model *mod(job.models[i]);
+    if (mod->blockgroup.pending_bitmap.empty())
+      continue;
+
+    if (job.vectorized[i])
+      mod->blockgroup.AppendBitmap(mod->blockgroup.pending_bitmap, job.polys[i], job.cached[i]);
+    mod->blockgroup.pending_bitmap.clear();
+    mod->AddBoundaryBlocks(); // around the bitmap
+  }
+  loading = false;
+
+  const double vectorized(seconds_now());
+
   FOR_EACH (it, models) {
-    (*it)->blockgroup.CalcSize();
     (*it)->UnMap(); // clears both layers
-    (*it)->Map(); // maps both layers
 
-    // to here
+    // models that never move are mapped once, into the static layer
+    (*it)->static_map = (*it)->Stationary();
   }
 
+  // size every model's blocks and find the pixels they cover
+  job.Run(LoadJob::RASTERIZE, worker_threads);
+
+  const size_t geometries(ShareGeometry());
+  printf(" [geometry %lu/%lu]", (unsigned long)geometries, (unsigned long)models.size());
+
+  const double rasterized(seconds_now());
+
+  // then render the blocks into the cells, one thread to a
+  // superregion, since regions and cells are created as they are
+  // needed. Superregions are created first, since the index of them
+  // takes one writer at a time.
+  job.Shard();
+  job.Run(LoadJob::MAP, worker_threads);
+  job.Run(LoadJob::FINISH, worker_threads);
+
+  const double mapped(seconds_now());
+
+  printf(" [occupancy %.1fMB]", OccupancyMemory() / 1e6);
+
   // the world is all done - run any init code for user's controllers
   FOR_EACH (it, models)
     (*it)->InitControllers();
 
+  const double done(seconds_now());
+
+  printf(" [load %.2fs: parse %.2f models %.2f bitmaps %.2f size+raster %.2f cells %.2f init "
+         "%.2f]",
+         done - load_started, parsed - load_started, created - parsed, vectorized - created,
+         rasterized - vectorized, mapped - rasterized, done - mapped);
+
   putchar('\n');
 }
 
@@ -480,7 +999,7 @@ void World::UnLoad()
   models_by_name.clear();
   models_by_wfentity.clear();
 
-  ray_list.clear();
+  ClearRays();
 
   // todo - clean up regions & superregions?
 
@@ -546,6 +1065,18 @@ void World::CallUpdateCallbacks()
   size_t threads(pending_update_callbacks.size());
   int cbcount(0);
 
+  // which thread updated each model depends on the scheduling, so
+  // for a repeatable order call the callbacks in order of model id
+  if (deterministic) {
+    std::vector<Model *> pending;
+    for (size_t t(0); t < threads; ++t)
+      for (std::queue<Model *> &q(pending_update_callbacks[t]); !q.empty(); q.pop())
+        pending.push_back(q.front());
+
+    std::sort(pending.begin(), pending.end(), Model::IdLess);
+    pending_update_callbacks[0] = std::queue<Model *>(std::deque<Model *>(pending.begin(), pending.end()));
+  }
+
   for (size_t t(0); t < threads; ++t) {
     std::queue<Model *> &q(pending_update_callbacks[t]);
 
@@ -573,77 +1104,254 @@ void World::CallUpdateCallbacks()
   }
 }
 
-void World::ConsumeQueue(unsigned int queue_num)
+const uint64_t World::EventQueue::SLOTS;
+
+void World::EventQueue::SetTick(usec_t interval, usec_t now)
 {
-  std::priority_queue<Event> &queue(event_queues[queue_num]);
+  // take everything out and put it back in with the new tick
+  std::vector<Event> all;
+  FOR_EACH (it, wheel) {
+    all.insert(all.end(), it->begin(), it->end());
+    it->clear();
+  }
+  wheel_count = 0;
 
-  if (queue.empty())
-    return;
+  tick = interval;
+  base = tick ? now / tick : 0;
 
-  // printf( "event queue len %d\n", (int)queue.size() );
+  FOR_EACH (it, all)
+    Push(*it);
+}
 
-  // update everything on the event queue that happens at this time or earlier
-  do {
-    Event ev(queue.top());
-    if (ev.time > sim_time)
-      break;
-    queue.pop();
+void World::EventQueue::Push(const Event &ev)
+{
+  if (tick && ev.time % tick == 0) {
+    const uint64_t n(ev.time / tick);
+    if (n >= base && n < base + SLOTS) {
+      wheel[n % SLOTS].push_back(ev);
+      ++wheel_count;
+      return;
+    }
+  }
+
+  heap.push(ev);
+}
+
+bool World::EventQueue::PopDue(usec_t now, std::vector<Event> &due)
+{
+  const size_t start(due.size());
+
+  if (tick) {
+    const uint64_t last(now / tick);
 
-    // printf( "Q%d @ %llu next event ptr %p cb %p\n", queue_num, sim_time,
-    // ev.mod, ev.cb );
-    // std::string modelType = ev.mod->GetModelType();
-    // printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(),
-    // ev.time, ev.mod->Token() );
+    if (wheel_count == 0) // nothing to drain, so skip straight to now
+      base = std::max(base, last + 1);
 
-    ev.cb(ev.mod, ev.arg); // call the event's callback on the model
-  } while (!queue.empty());
+    for (; base <= last; ++base) {
+      const usec_t time(base * tick);
+
+      // heap events earlier than this tick come first
+      while (!heap.empty() && heap.top().time < time) {
+        due.push_back(heap.top());
+        heap.pop();
+      }
+
+      std::vector<Event> &bucket(wheel[base % SLOTS]);
+      due.insert(due.end(), bucket.begin(), bucket.end());
+      wheel_count -= bucket.size();
+      bucket.clear();
+    }
+  }
+
+  while (!heap.empty() && heap.top().time <= now) {
+    due.push_back(heap.top());
+    heap.pop();
+  }
+
+  return due.size() > start;
 }
 
-bool World::Update()
+void World::ConsumeQueue(unsigned int queue_num)
 {
-  // printf( "cells: %u blocks %u\n", Cell::count, Block::count );
+  EventQueue &queue(event_queues[queue_num]);
+
+  // update everything on the event queue that happens at this time
+  // or earlier, including any events the callbacks create that are
+  // already due
+  while (queue.PopDue(sim_time, main_events)) {
+    FOR_EACH (it, main_events)
+      it->cb(it->mod, it->arg); // call the event's callback on the model
+    main_events.clear();
+  }
+}
 
-  // puts( "World::Update()" );
+bool World::ShareDueEvents()
+{
+  due_events.clear();
 
-  // if we've run long enough, exit
-  if (PastQuitTime() || World::quit_all || this->quit)
-    return true;
+  for (size_t q(1); q < event_queues.size(); ++q)
+    event_queues[q].PopDue(sim_time, due_events);
 
-  if (show_clock && ((this->updates % show_clock_interval) == 0)) {
-    printf("\r[Stage: %s]", ClockString().c_str());
-    fflush(stdout);
+  FOR_EACH (it, move_groups)
+    due_events.push_back(Event(sim_time, NULL, World::MoveGroup, &*it));
+
+  // give each worker an equal contiguous share to start with
+  const size_t count(due_events.size());
+  for (size_t t(0); t < worker_threads; ++t) {
+    work_ranges[t]->begin = count * t / worker_threads;
+    work_ranges[t]->end = count * (t + 1) / worker_threads;
   }
 
-  sim_time += sim_interval;
+  return count > 0;
+}
+
+bool World::TakeWork(unsigned int worker, size_t &begin, size_t &end)
+{
+  // events are taken a few at a time: small enough that one
+  // expensive model can't leave the others idle, large enough to
+  // keep the locking cheap
+  const size_t chunk(4);
+
+  // our own range first, from the front
+  WorkRange &own(*work_ranges[worker - 1]);
+  pthread_mutex_lock(&own.mutex);
+  if (own.begin < own.end) {
+    begin = own.begin;
+    end = std::min(own.begin + chunk, own.end);
+    own.begin = end;
+    pthread_mutex_unlock(&own.mutex);
+    return true;
+  }
+  pthread_mutex_unlock(&own.mutex);
+
+  // then steal from the back of the other workers' ranges
+  for (unsigned int i(1); i < worker_threads; ++i) {
+    WorkRange &victim(*work_ranges[(worker - 1 + i) % worker_threads]);
+    pthread_mutex_lock(&victim.mutex);
+    if (victim.begin < victim.end) {
+      end = victim.end;
+      begin = std::max(victim.begin, victim.end - std::min(chunk, victim.end));
+      victim.end = begin;
+      pthread_mutex_unlock(&victim.mutex);
+      return true;
+    }
+    pthread_mutex_unlock(&victim.mutex);
+  }
+
+  return false;
+}
+
+void World::RunWork(unsigned int worker)
+{
+  struct timeval start, finish;
+  gettimeofday(&start, NULL);
+
+  size_t begin, end;
+  while (TakeWork(worker, begin, end))
+    for (size_t i(begin); i < end; ++i) {
+      const Event &ev(due_events[i]);
+      ev.cb(ev.mod, ev.arg); // call the event's callback on the model
+    }
+
+  gettimeofday(&finish, NULL);
+  worker_busy[worker - 1] +=
+      (finish.tv_sec - start.tv_sec) + (finish.tv_usec - start.tv_usec) / 1e6;
+}
+
+// the side, in pixels, of the squares of the world that robot moves
+// are grouped by: 8 regions, about 5m at the default resolution
+const int32_t MOVE_PARTITION_BITS(RBITS + 3);
+
+static size_t FindGroup(std::vector<size_t> &parent, size_t i)
+{
+  while (parent[i] != i)
+    i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+void World::GroupMoves()
+{
+  move_groups.clear();
+
+  const unsigned int layer(updates % 2);
 
-  // rebuild the sets sorted by position on x,y axis
-  models_with_fiducials_byx.clear();
-  models_with_fiducials_byy.clear();
+  std::vector<ModelPosition *> movers;
+  // the partitions and root models each mover touches
+  std::vector<std::pair<int64_t, size_t> > partitions;
+  std::vector<std::pair<Model *, size_t> > roots;
 
-  FOR_EACH (it, models_with_fiducials) {
-    models_with_fiducials_byx.insert(*it);
-    models_with_fiducials_byy.insert(*it);
+  FOR_EACH (it, active_velocity) {
+    Bounds x, y;
+    if (!(*it)->MoveExtent(layer, x, y))
+      continue;
+
+    const size_t i(movers.size());
+    movers.push_back(*it);
+    roots.push_back(std::make_pair((*it)->Root(), i));
+
+    // one pixel of slack for rounding
+    const int32_t x0(floor(x.min * ppm) - 1), x1(floor(x.max * ppm) + 1);
+    const int32_t y0(floor(y.min * ppm) - 1), y1(floor(y.max * ppm) + 1);
+
+    for (int32_t py(y0 >> MOVE_PARTITION_BITS); py <= (y1 >> MOVE_PARTITION_BITS); ++py)
+      for (int32_t px(x0 >> MOVE_PARTITION_BITS); px <= (x1 >> MOVE_PARTITION_BITS); ++px)
+        partitions.push_back(std::make_pair((int64_t(px) << 32) | uint32_t(py), i));
+
+    // the superregion index can't be changed while the workers are
+    // reading it, so create any superregions the move needs now
+    for (int32_t sy(y0 >> SRBITS); sy <= (y1 >> SRBITS); ++sy)
+      for (int32_t sx(x0 >> SRBITS); sx <= (x1 >> SRBITS); ++sx)
+        GetSuperRegionCreate(point_int_t(sx, sy));
   }
 
-  // printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
-  //			models_with_fiducials_byx.size() );
+  // robots that share a partition or a root model may affect each
+  // other, so they join the same group
+  std::vector<size_t> parent(movers.size());
+  for (size_t i(0); i < parent.size(); ++i)
+    parent[i] = i;
+
+  std::sort(partitions.begin(), partitions.end());
+  for (size_t k(1); k < partitions.size(); ++k)
+    if (partitions[k].first == partitions[k - 1].first)
+      parent[FindGroup(parent, partitions[k].second)] = FindGroup(parent, partitions[k - 1].second);
+
+  std::sort(roots.begin(), roots.end());
+  for (size_t k(1); k < roots.size(); ++k)
+    if (roots[k].first == roots[k - 1].first)
+      parent[FindGroup(parent, roots[k].second)] = FindGroup(parent, roots[k - 1].second);
+
+  // movers are in the serial order, and keep it within their groups
+  std::vector<size_t> group_of(movers.size(), movers.size());
+  for (size_t i(0); i < movers.size(); ++i) {
+    const size_t root(FindGroup(parent, i));
+    if (group_of[root] == movers.size()) {
+      group_of[root] = move_groups.size();
+      move_groups.push_back(std::vector<ModelPosition *>());
+    }
+    move_groups[group_of[root]].push_back(movers[i]);
+  }
+}
 
-  // handle the zeroth queue synchronously in the main thread
-  ConsumeQueue(0);
+int World::MoveGroup(Model *, void *group)
+{
+  std::vector<ModelPosition *> &movers(*static_cast<std::vector<ModelPosition *> *>(group));
+  FOR_EACH (it, movers)
+    (*it)->Move();
+  return 0;
+}
 
-  // handle all the remaining queues asynchronously in worker threads
+void World::StartWorkers()
+{
   pthread_mutex_lock(&sync_mutex);
   threads_working = worker_threads;
   // unblock the workers - they are waiting on this condition var
   // puts( "main thread signalling workers" );
   pthread_cond_broadcast(&threads_start_cond);
   pthread_mutex_unlock(&sync_mutex);
+}
 
-  // update the position of all position models based on their velocity
-  // while sensor models are running in other threads
-  FOR_EACH (it, active_velocity)
-    (*it)->Move();
-
+void World::WaitForWorkers()
+{
   pthread_mutex_lock(&sync_mutex);
   // wait for all the last update job to complete - it will
   // signal the worker_threads_done condition var
@@ -654,6 +1362,95 @@ bool World::Update()
   pthread_mutex_unlock(&sync_mutex);
   // puts( "main thread awakes" );
 
+  // now it's safe to queue the events the workers created
+  for (size_t t(1); t < deferred_events.size(); ++t) {
+    FOR_EACH (it, deferred_events[t])
+      event_queues[it->first].Push(it->second);
+    deferred_events[t].clear();
+  }
+}
+
+bool World::Update()
+{
+  // printf( "cells: %u blocks %u\n", Cell::count, Block::count );
+
+  // puts( "World::Update()" );
+
+  // if we've run long enough, exit
+  if (PastQuitTime() || World::quit_all || this->quit)
+    return true;
+
+  if (show_clock && ((this->updates % show_clock_interval) == 0)) {
+    printf("\r[Stage: %s]", ClockString().c_str());
+    if (worker_threads > 1) {
+      printf(" [busy");
+      for (unsigned int t(0); t < worker_threads; ++t)
+        printf(" %.1f", worker_busy[t]);
+      printf("s]");
+    }
+    fflush(stdout);
+  }
+
+  sim_time += sim_interval;
+
+  // bring the index of fiducials up to date with the moves made since
+  // the last update
+  FOR_EACH (thread, moved_fiducials) {
+    FOR_EACH (it, *thread)
+      fiducial_index.Move(*it);
+    thread->clear();
+  }
+
+  // handle the zeroth queue synchronously in the main thread
+  ConsumeQueue(0);
+
+  // with several worker threads, the position models are moved in
+  // parallel too, in groups that can't affect each other. In
+  // deterministic mode they are moved after the sensors are done, so
+  // no sensor sees a model part way through its move.
+  const bool parallel_moves(worker_threads > 1);
+  if (parallel_moves && !deterministic)
+    GroupMoves();
+
+  // handle all the remaining queues asynchronously in worker threads
+  const bool working(ShareDueEvents());
+  if (working)
+    StartWorkers();
+
+  // otherwise update the position of all position models based on
+  // their velocity while sensor models are running in other threads
+  if (!parallel_moves && !deterministic)
+    FOR_EACH (it, active_velocity)
+      (*it)->Move();
+
+  if (working) {
+    WaitForWorkers();
+    move_groups.clear();
+
+    // the workers may have created events that are already due
+    while (ShareDueEvents()) {
+      StartWorkers();
+      WaitForWorkers();
+    }
+  }
+
+  if (deterministic) {
+    if (parallel_moves) {
+      GroupMoves();
+      if (ShareDueEvents()) {
+        StartWorkers();
+        WaitForWorkers();
+      }
+      move_groups.clear();
+    } else
+      FOR_EACH (it, active_velocity)
+        (*it)->Move();
+  }
+
+  // no worker is running, so nothing can be reading the superregion
+  // tables replaced during this update
+  superregions.Reclaim();
+
   // TODO: allow threadsafe callbacks to be called in worker
   // threads
 
@@ -674,12 +1471,10 @@ bool World::Update()
 
 unsigned int World::GetEventQueue(Model *) const
 {
-  // todo: there should be a policy that works faster than random, but
-  // random should do a good core load balancing.
-
-  if (worker_threads < 1)
-    return 0;
-  return ((random() % worker_threads) + 1);
+  // the due events of all the worker queues are shared out between
+  // the workers at each update, so the choice of queue does not
+  // affect the load balance.
+  return (worker_threads < 1 ? 0 : 1);
 }
 
 Model *World::GetModel(const std::string &name) const
@@ -695,23 +1490,18 @@ Model *World::GetModel(const std::string &name) const
     return it->second; // the Model*
 }
 
-void World::RecordRay(double x1, double y1, double x2, double y2)
+void World::ClearRays()
 {
-  float *drawpts(new float[4]);
-  drawpts[0] = x1;
-  drawpts[1] = y1;
-  drawpts[2] = x2;
-  drawpts[3] = y2;
-  ray_list.push_back(drawpts);
+  FOR_EACH (it, ray_records)
+    it->Clear();
 }
 
-void World::ClearRays()
+uint64_t World::DroppedRays() const
 {
-  // destroy the C arrays first
-  FOR_EACH (it, ray_list)
-    delete[] * it;
-
-  ray_list.clear();
+  uint64_t dropped(0);
+  FOR_EACH (it, ray_records)
+    dropped += it->Dropped();
+  return dropped;
 }
 
 // Perform multiple raytraces evenly spaced over an angular field of view
@@ -724,19 +1514,52 @@ void World::Raytrace(const Pose &gpose, // global pose
 		     const bool ztest,
                      std::vector<RaytraceResult> &results)
 {
-  // find the direction of the first ray
-  Pose raypose(gpose);
-  const double starta(fov / 2.0 - raypose.a);
+  Raytrace(gpose, range, fov, RayMatchFunc(func, arg), mod, ztest, results);
+}
 
-  // set up a ray to trace
-  Ray ray(mod, gpose, range, func, arg, ztest);
+void World::RaytraceFan(const Ray &ray, const std::vector<radians_t> &angles,
+                        std::vector<RaytraceResult> &results)
+{
+  RaytraceFan(ray, angles, results, RayMatchFunc(ray.func, ray.arg));
+}
 
-  const size_t sample_count = results.size();
+template <class Pred>
+void World::RaytraceFan(const Ray &ray, const std::vector<radians_t> &angles,
+                        std::vector<RaytraceResult> &results, const Pred &pred)
+{
+  const size_t sample_count(angles.size());
+  results.resize(sample_count);
+
+  // choose the z-test once for the whole fan
+  RaytraceResult (World::*trace)(const Ray &, const Pred &, const double, const double,
+                                 SuperRegionCache &)(
+      ray.ztest ? &World::TraceRay<Pred, true, true> : &World::TraceRay<Pred, false, true>);
+
+  // every ray in the fan starts in the same superregion, and
+  // neighbouring rays tend to cross the same superregions, so one
+  // cache serves the whole fan
+  SuperRegionCache cache;
+  Ray r(ray);
+
+  // the trig for a batch of rays is done together in a tight loop
+  // before tracing them
+  const size_t BATCH(64);
+  double sines[BATCH], cosines[BATCH];
+
+  for (size_t base(0); base < sample_count; base += BATCH) {
+    const size_t n(std::min(BATCH, sample_count - base));
+
+    for (size_t i(0); i < n; ++i) {
+      // eliminate a potential divide by zero
+      const double angle(angles[base + i] == 0.0 ? 1e-12 : angles[base + i]);
+      sines[i] = sin(angle);
+      cosines[i] = cos(angle);
+    }
 
-  for (size_t s(0); s < sample_count; ++s) {
-    // aim the ray in the right direction before tracing
-    ray.origin.a = (s * fov / (double)(sample_count - 1)) - starta;
-    results[s] = Raytrace(ray);
+    for (size_t i(0); i < n; ++i) {
+      r.origin.a = angles[base + i];
+      results[base + i] = (this->*trace)(r, pred, sines[i], cosines[i], cache);
+    }
   }
 }
 
@@ -751,6 +1574,52 @@ RaytraceResult World::Raytrace(const Pose &gpose,
 }
 
 RaytraceResult World::Raytrace(const Ray &r)
+{
+  return Raytrace(r, RayMatchFunc(r.func, r.arg));
+}
+
+template <class Pred> RaytraceResult World::Raytrace(const Ray &r, const Pred &pred)
+{
+  // eliminate a potential divide by zero
+  const double angle(r.origin.a == 0.0 ? 1e-12 : r.origin.a);
+
+  SuperRegionCache cache;
+  if (r.ztest)
+    return TraceRay<Pred, true, true>(r, pred, sin(angle), cos(angle), cache);
+  else
+    return TraceRay<Pred, false, true>(r, pred, sin(angle), cos(angle), cache);
+}
+
+Model *World::LineOfSight(const Pose &pose, const point_t &to, const ray_test_func_t func,
+                          const Model *finder, const void *arg, const bool ztest)
+{
+  return LineOfSight(pose, to, RayMatchFunc(func, arg), finder, ztest);
+}
+
+template <class Pred>
+Model *World::LineOfSight(const Pose &pose, const point_t &to, const Pred &pred,
+                          const Model *finder, const bool ztest)
+{
+  const double dx(to.x - pose.x), dy(to.y - pose.y);
+  const double range(hypot(dx, dy));
+
+  const double angle(atan2(dy, dx));
+  const Ray r(finder, Pose(pose.x, pose.y, pose.z, angle), range, NULL, NULL, ztest);
+
+  // eliminate a potential divide by zero
+  const double sina(sin(angle == 0.0 ? 1e-12 : angle));
+  const double cosa(cos(angle == 0.0 ? 1e-12 : angle));
+
+  SuperRegionCache cache;
+  if (ztest)
+    return TraceRay<Pred, true, false>(r, pred, sina, cosa, cache).mod;
+  else
+    return TraceRay<Pred, false, false>(r, pred, sina, cosa, cache).mod;
+}
+
+template <class Pred, bool ZTEST, bool MEASURE>
+RaytraceResult World::TraceRay(const Ray &r, const Pred &pred, const double sina,
+                               const double cosa, SuperRegionCache &cache)
 {
   // rt_cells.clear();
   // rt_candidate_cells.clear();
@@ -766,10 +1635,6 @@ RaytraceResult World::Raytrace(const Ray &r)
   const double startx(globx);
   const double starty(globy);
 
-  // eliminate a potential divide by zero
-  const double angle(r.origin.a == 0.0 ? 1e-12 : r.origin.a);
-  const double sina(sin(angle));
-  const double cosa(cos(angle));
   const double tana(sina / cosa); // approximately tan(angle) but faster
 
   // the x and y components of the ray (these need to be doubles, or a
@@ -798,7 +1663,10 @@ RaytraceResult World::Raytrace(const Ray &r)
   const double xjumpdist(fabs(xjumpx) + fabs(xjumpy));
   const double yjumpdist(fabs(yjumpx) + fabs(yjumpy));
 
+  // the layer of moving models that is not being written this
+  // update, and the layer of models that never move
   const unsigned int layer((updates + 1) % 2);
+  const unsigned int layers[2] = { layer, STATIC_LAYER };
 
   // these are updated as we go along the ray
   double xcrossx(0), xcrossy(0);
@@ -814,10 +1682,17 @@ RaytraceResult World::Raytrace(const Ray &r)
   // slow in debug builds. Add them in if chasing a suspected raytrace bug
   while (n > 0) // while we are still not at the ray end
   {
-    SuperRegion *sr(GetSuperRegion(point_int_t(GETSREG(globx), GETSREG(globy))));
+    const point_int_t sup(GETSREG(globx), GETSREG(globy));
+    if (!cache.valid || !(cache.origin == sup)) {
+      cache.origin = sup;
+      cache.sr = GetSuperRegion(sup);
+      cache.valid = true;
+    }
+    SuperRegion *sr(cache.sr);
     Region *reg(sr ? sr->GetRegion(GETREG(globx), GETREG(globy)) : NULL);
 
-    if (reg && reg->count) // if the region contains any objects
+    if (reg && reg->count
+        && (reg->Occupied(layer) || reg->Occupied(STATIC_LAYER))) // if the region contains any objects
     {
       // assert( reg->cells.size() );
 
@@ -835,27 +1710,36 @@ RaytraceResult World::Raytrace(const Ray &r)
       // while within the bounds of this region and while some ray remains
       // we'll tweak the cell pointer directly to move around quickly
       while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
-        FOR_EACH (it, c->blocks[layer]) {
-          Block *block(*it);
-          assert(block);
-
-          // skip if not in the right z range
-          if (r.ztest && (r.origin.z < block->global_z.min || r.origin.z > block->global_z.max))
-            continue;
-
-          // test the predicate we were passed
-          if ((*r.func)(&block->group->mod, r.mod, r.arg)) {
-            // a hit!
-            result.pose = r.origin;
-            result.mod = &block->group->mod;
-            result.color = result.mod->GetColor();
-
-            if (ax > ay) // faster than the equivalent hypot() call
-              result.range = fabs((globx - startx) / cosa) / ppm;
-            else
-              result.range = fabs((globy - starty) / sina) / ppm;
-
-            return result;
+        // only look inside cells that the occupancy bitmaps say are
+        // not empty, first for moving models and then static ones
+        for (unsigned int l = 0; l < 2; ++l) {
+          if (reg->Occupied(layers[l], cx, cy)) {
+            FOR_EACH (it, c->blocks[layers[l]]) {
+              Block *block(*it);
+              assert(block);
+
+              // skip if not in the right z range
+              if (ZTEST && (r.origin.z < block->global_z.min || r.origin.z > block->global_z.max))
+                continue;
+
+              // test the predicate we were passed
+              if (pred(&block->group->mod, r.mod)) {
+                // a hit!
+                result.pose = r.origin;
+                result.mod = &block->group->mod;
+
+                if (MEASURE) {
+                  result.color = result.mod->GetColor();
+
+                  if (ax > ay) // faster than the equivalent hypot() call
+                    result.range = fabs((globx - startx) / cosa) / ppm;
+                  else
+                    result.range = fabs((globy - starty) / sina) / ppm;
+                }
+
+                return result;
+              }
+            }
           }
         }
 
@@ -959,6 +1843,30 @@ RaytraceResult World::Raytrace(const Ray &r)
   return result;
 }
 
+// the ray predicates that may be used with the templated raytracers
+template RaytraceResult World::Raytrace(const Ray &, const RayMatchFunc &);
+template RaytraceResult World::Raytrace(const Ray &, const RayMatchUnrelated &);
+template RaytraceResult World::Raytrace(const Ray &, const RayMatchRanger &);
+template RaytraceResult World::Raytrace(const Ray &, const RayMatchGripper &);
+
+template void World::RaytraceFan(const Ray &, const std::vector<radians_t> &,
+                                 std::vector<RaytraceResult> &, const RayMatchFunc &);
+template void World::RaytraceFan(const Ray &, const std::vector<radians_t> &,
+                                 std::vector<RaytraceResult> &, const RayMatchUnrelated &);
+template void World::RaytraceFan(const Ray &, const std::vector<radians_t> &,
+                                 std::vector<RaytraceResult> &, const RayMatchRanger &);
+template void World::RaytraceFan(const Ray &, const std::vector<radians_t> &,
+                                 std::vector<RaytraceResult> &, const RayMatchGripper &);
+
+template Model *World::LineOfSight(const Pose &, const point_t &, const RayMatchFunc &,
+                                   const Model *, const bool);
+template Model *World::LineOfSight(const Pose &, const point_t &, const RayMatchUnrelated &,
+                                   const Model *, const bool);
+template Model *World::LineOfSight(const Pose &, const point_t &, const RayMatchRanger &,
+                                   const Model *, const bool);
+template Model *World::LineOfSight(const Pose &, const point_t &, const RayMatchGripper &,
+                                   const Model *, const bool);
+
 static int _save_cb(Model *mod, void *)
 {
   mod->Save();
@@ -986,69 +1894,88 @@ void World::Reload(void)
 // add a block to each cell described by a polygon in world coordinates
 void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned int layer)
 {
+  std::vector<Cell *> cells;
+  PolyCells(pts, cells);
+
+  FOR_EACH (it, cells)
+    (*it)->AddBlock(block, layer);
+}
+
+// find each cell described by a polygon in world coordinates
+void World::PolyCells(const std::vector<point_int_t> &pts, std::vector<Cell *> &cells)
+{
+  std::vector<point_int_t> pixels;
+  PolyPixels(pts, pixels);
+  PixelCells(pixels, cells);
+}
+
+void World::PolyPixels(const std::vector<point_int_t> &pts, std::vector<point_int_t> &pixels)
+{
+  pixels.clear();
+
   const size_t pt_count(pts.size());
 
+  // line rasterization adapted from Cohen's 3D version in
+  // Graphics Gems II. Should be very fast.
   for (size_t i(0); i < pt_count; ++i) {
     const point_int_t &start(pts[i]);
     const point_int_t &end(pts[(i + 1) % pt_count]);
 
-    // line rasterization adapted from Cohen's 3D version in
-    // Graphics Gems II. Should be very fast.
     const int32_t dx(end.x - start.x);
     const int32_t dy(end.y - start.y);
     const int32_t sx(sgn(dx));
     const int32_t sy(sgn(dy));
-    const int32_t ax(std::abs(dx));
-    const int32_t ay(std::abs(dy));
-    const int32_t bx(2 * ax);
-    const int32_t by(2 * ay);
+    const int32_t bx(2 * std::abs(dx));
+    const int32_t by(2 * std::abs(dy));
 
-    int32_t exy(ay - ax);
-    int32_t n(ax + ay);
+    int32_t exy(std::abs(dy) - std::abs(dx));
+    int32_t n(std::abs(dx) + std::abs(dy));
 
-    int32_t globx(start.x);
-    int32_t globy(start.y);
+    point_int_t pix(start);
 
-    while (n) {
-      Region *reg(GetSuperRegionCreate(point_int_t(GETSREG(globx), GETSREG(globy)))
-                      ->GetRegion(GETREG(globx), GETREG(globy)));
-      assert(reg);
+    while (n--) {
+      pixels.push_back(pix);
 
-      // add all the required cells in this region before looking up
-      // another region
-      int32_t cx(GETCELL(globx));
-      int32_t cy(GETCELL(globy));
+      if (exy < 0) {
+        pix.x += sx;
+        exy += by;
+      } else {
+        pix.y += sy;
+        exy -= bx;
+      }
+    }
+  }
 
-      // need to call Region::GetCell() before using a Cell pointer
-      // directly, because the region allocates cells lazily, waiting
-      // for a call of this method
-      Cell *c(reg->GetCell(cx, cy));
+  std::sort(pixels.begin(), pixels.end());
+  pixels.erase(std::unique(pixels.begin(), pixels.end()), pixels.end());
+}
 
-      // while inside the region, manipulate the Cell pointer directly
-      while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
-        // if the block is not already rendered in the cell
-        // if( find (block->rendered_cells[layer].begin(),
-        // block->rendered_cells[layer].end(), c )
-        // == block->rendered_cells[layer].end() )
-        c->AddBlock(block, layer);
-
-        // cleverly skip to the next cell (now it's safe to
-        // manipulate the cell pointer)
-        if (exy < 0) {
-          globx += sx;
-          exy += by;
-          c += sx;
-          cx += sx;
-        } else {
-          globy += sy;
-          exy -= bx;
-          c += sy * REGIONWIDTH;
-          cy += sy;
-        }
-        --n;
-      }
+void World::PixelCells(const std::vector<point_int_t> &pixels, std::vector<Cell *> &cells)
+{
+  cells.clear();
+  cells.reserve(pixels.size());
+
+  // the pixels are sorted, so runs of them fall in the same region
+  Region *reg(NULL);
+  point_int_t sreg, rxy;
+
+  FOR_EACH (it, pixels) {
+    const point_int_t s(GETSREG(it->x), GETSREG(it->y));
+    const point_int_t r(GETREG(it->x), GETREG(it->y));
+    if (!reg || !(s == sreg) || !(r == rxy)) {
+      reg = GetSuperRegionCreate(s)->GetRegion(r.x, r.y);
+      assert(reg);
+      sreg = s;
+      rxy = r;
     }
+
+    // need to call Region::GetCell() before using a Cell pointer
+    // directly, because the region allocates cells lazily
+    cells.push_back(reg->GetCell(GETCELL(it->x), GETCELL(it->y)));
   }
+
+  // distinct pixels are distinct cells
+  std::sort(cells.begin(), cells.end());
 }
 
 SuperRegion *World::AddSuperRegion(const point_int_t &sup)
@@ -1065,15 +1992,7 @@ SuperRegion *World::AddSuperRegion(const point_int_t &sup)
 
 inline SuperRegion *World::GetSuperRegion(const point_int_t &org)
 {
-  SuperRegion *sr(NULL);
-
-  // I despise some STL syntax sometimes...
-  std::map<point_int_t, SuperRegion *>::iterator it(superregions.find(org));
-
-  if (it != superregions.end())
-    sr = it->second;
-
-  return sr;
+  return superregions.Find(org);
 }
 
 inline SuperRegion *World::GetSuperRegionCreate(const point_int_t &org)
@@ -27,9 +27,11 @@
  * CVS info: $Id$
  */
 
+#include <algorithm>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <iterator> // for std::istreambuf_iterator
 #include <limits.h> // for PATH_MAX
 #include <math.h>
 #include <stdarg.h>
@@ -59,8 +61,9 @@ using namespace Stg;
 ///////////////////////////////////////////////////////////////////////////
 // Default constructor
 Worldfile::Worldfile()
-    : tokens(), macros(), entities(), properties(), filename(), unit_length(1.0),
-      unit_angle(M_PI / 180.0)
+    : tokens(), texts(), macros(), entities(), prototypes(), property_names(), property_ids(), filename(),
+      unit_length(1.0),
+      unit_angle(M_PI / 180.0), compiling(false)
 {
 }
 
@@ -120,8 +123,13 @@ bool Worldfile::Load(std::istream &world_content, const std::string &filename)
 
   ClearTokens();
 
-  // Read tokens from the stream
-  if (!LoadTokens(world_content, 0))
+  // Read the whole stream, then its tokens
+  texts.push_back(std::string());
+  texts.back().assign(std::istreambuf_iterator<char>(world_content),
+                      std::istreambuf_iterator<char>());
+
+  // a compiled world has no tokens to read
+  if (!IsCompiled() && !LoadTokens(0))
     return false;
 
   return LoadCommon();
@@ -141,8 +149,8 @@ bool Worldfile::Load(const std::string &filename)
 
   ClearTokens();
 
-  // Read tokens from the file
-  if (!LoadTokens(file, 0)) {
+  // Read the whole file, then its tokens unless it is compiled
+  if (!LoadText(file) || (!IsCompiled() && !LoadTokens(0))) {
     // DumpTokens();
     fclose(file);
     return false;
@@ -154,14 +162,18 @@ bool Worldfile::Load(const std::string &filename)
 
 bool Worldfile::LoadCommon()
 {
-  // Parse the tokens to identify entities
-  if (!ParseTokens()) {
+  // Parse the tokens to identify entities, or read them ready-made
+  // from a compiled world
+  if (IsCompiled()) {
+    if (!LoadCompiled())
+      return false;
+  } else if (!ParseTokens()) {
     // DumpTokens();
     return false;
   }
 
   // Dump contents and exit if this file is meant for debugging only.
-  if (ReadInt(0, "test", 0) != 0) {
+  if (!compiling && ReadInt(0, "test", 0) != 0) {
     PRINT_ERR("this is a test file; quitting");
     DumpTokens();
     DumpMacros();
@@ -198,6 +210,13 @@ bool Worldfile::Save(const std::string &filename)
   // Debugging
   // DumpProperties();
 
+  // the tokens of a compiled world are only its values
+  if (IsCompiled()) {
+    PRINT_ERR1("unable to save world file %s : the world was loaded from a compiled file",
+               filename.c_str());
+    return false;
+  }
+
   // Open file
   FILE *file = fopen(filename.c_str(), "w+");
   // FILE *file = FileOpen(filename, "w+");
@@ -219,429 +238,390 @@ bool Worldfile::Save(const std::string &filename)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Check for unused properties and print warnings
-bool Worldfile::WarnUnused()
+// Compiled world files hold the entities and properties of a parsed
+// world. After the header comes a table of every distinct string,
+// each a uint32_t length followed by the characters and a zero. Then
+// come the entities, each its parent and the string id of its type,
+// and the properties, each its entity, line, name and values, with
+// strings given by their ids. Everything is in host byte order.
+static const char COMPILED_MAGIC[8] = { 'S', 'T', 'G', 'W', 'O', 'R', 'L', 'D' };
+static const uint32_t COMPILED_VERSION = 1;
+
+template <class T> static void append_value(std::string &out, const T &value)
 {
-  bool unused = false;
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
 
-  FOR_EACH (it, properties) {
-    if (!it->second->used) {
-      PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used", this->filename.c_str(),
-                  it->second->line, it->second->name.c_str());
-      unused = true;
-    }
+template <class T> static bool read_value(const char **p, const char *end, T &value)
+{
+  if ((size_t)(end - *p) < sizeof(value))
+    return false;
+  memcpy(&value, *p, sizeof(value));
+  *p += sizeof(value);
+  return true;
+}
+
+// collects the distinct strings of a compiled world
+class CStringTable {
+public:
+  std::map<std::string, uint32_t> ids;
+  std::string data;
+
+  uint32_t Id(const std::string &str)
+  {
+    std::map<std::string, uint32_t>::iterator it = ids.find(str);
+    if (it != ids.end())
+      return it->second;
+
+    const uint32_t id = ids.size();
+    ids.insert(std::make_pair(str, id));
+    append_value(data, (uint32_t)str.size());
+    data.append(str.c_str(), str.size() + 1);
+    return id;
   }
+};
 
-  return unused;
+///////////////////////////////////////////////////////////////////////////
+// Load a world file and save it compiled
+bool Worldfile::Compile(const std::string &filename, const std::string &output)
+{
+  compiling = true;
+  const bool ok = Load(filename);
+  compiling = false;
+
+  return ok && SaveCompiled(output);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Load tokens from a stream.
-bool Worldfile::LoadTokens(std::istream &content, int include)
+// Save the parsed world to a compiled file
+bool Worldfile::SaveCompiled(const std::string &filename)
 {
-  int line;
-  char token[256];
+  CStringTable strings;
+  std::string body;
 
-  line = 1;
+  append_value(body, (uint32_t)entities.size());
+  FOR_EACH (it, entities) {
+    append_value(body, (int32_t)it->parent);
+    append_value(body, strings.Id(it->type));
+  }
 
-  while (true) {
-    int ch = content.get();
-    if (ch == EOF)
-      break;
+  std::string props;
+  uint32_t count = 0;
+
+  for (size_t entity = 0; entity < entities.size(); entity++) {
+    // look up named colors now, rather than in rgb.txt at every load
+    CProperty *color = GetProperty(entity, "color");
+    std::string colorstr;
+    if (color && !color->values.empty())
+      colorstr = GetTokenValue(color->values[0]);
+    const bool resolve = !colorstr.empty() && colorstr != "random";
+
+    // an instance is written out with its own copy of the properties
+    // it shares
+    std::vector<std::pair<int, CProperty *> > properties;
+    GetEntityProperties(entity, properties);
+
+    FOR_EACH (it, properties) {
+      const CProperty *property = it->second;
+
+      if (resolve && (property->name == "color" || property->name == "color_rgba"))
+        continue;
+
+      append_value(props, (int32_t)entity);
+      append_value(props, (int32_t)property->line);
+      append_value(props, strings.Id(property->name));
+      append_value(props, (uint32_t)property->values.size());
+      FOR_EACH (vit, property->values) {
+        append_value(props, (uint8_t)tokens[*vit].type);
+        append_value(props, strings.Id(GetTokenValue(*vit)));
+      }
+      count++;
+    }
 
-    if ((char)ch == '#') {
-      content.putback(ch);
-      if (!LoadTokenComment(content, &line, include))
-        return false;
-    } else if (isalpha(ch)) {
-      content.putback(ch);
-      if (!LoadTokenWord(content, &line, include))
-        return false;
-    } else if (strchr("+-.0123456789", ch)) {
-      content.putback(ch);
-      if (!LoadTokenNum(content, &line, include))
-        return false;
-    } else if (isblank(ch)) {
-      content.putback(ch);
-      if (!LoadTokenSpace(content, &line, include))
-        return false;
-    } else if (ch == '"') {
-      content.putback(ch);
-      if (!LoadTokenString(content, &line, include))
-        return false;
-    } else if (strchr("(", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenOpenEntity, token, include);
-    } else if (strchr(")", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenCloseEntity, token, include);
-    } else if (strchr("[", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenOpenTuple, token, include);
-    } else if (strchr("]", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenCloseTuple, token, include);
-    } else if (0x0d == ch) {
-      ch = content.get();
-      if (0x0a != ch)
-        content.putback(ch);
-      line++;
-      AddToken(TokenEOL, "\n", include);
-    } else if (0x0a == ch) {
-      ch = content.get();
-      if (0x0d != ch)
-        content.putback(ch);
-      line++;
-      AddToken(TokenEOL, "\n", include);
-    } else {
-      TOKEN_ERR("syntax error", line);
-      return false;
+    if (resolve) {
+      const Color c(colorstr);
+      const double rgba[4] = { c.r, c.g, c.b, c.a };
+
+      append_value(props, (int32_t)entity);
+      append_value(props, (int32_t)color->line);
+      append_value(props, strings.Id("color_rgba"));
+      append_value(props, (uint32_t)4);
+      for (int i = 0; i < 4; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.6f", rgba[i]);
+        append_value(props, (uint8_t)TokenNum);
+        append_value(props, strings.Id(buf));
+      }
+      count++;
     }
   }
 
-  return true;
-}
+  append_value(body, count);
 
-// Load tokens from a file.
-bool Worldfile::LoadTokens(FILE *file, int include)
-{
-  int line;
-  char token[256];
+  std::string header(COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+  append_value(header, COMPILED_VERSION);
+  append_value(header, (uint32_t)strings.ids.size());
 
-  line = 1;
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (!file) {
+    PRINT_ERR2("unable to save compiled world file %s : %s", filename.c_str(), strerror(errno));
+    return false;
+  }
 
-  while (true) {
-    int ch = fgetc(file);
-    if (ch == EOF)
-      break;
+  const bool ok = fwrite(header.data(), 1, header.size(), file) == header.size()
+                  && fwrite(strings.data.data(), 1, strings.data.size(), file) == strings.data.size()
+                  && fwrite(body.data(), 1, body.size(), file) == body.size()
+                  && fwrite(props.data(), 1, props.size(), file) == props.size();
 
-    if ((char)ch == '#') {
-      ungetc(ch, file);
-      if (!LoadTokenComment(file, &line, include))
-        return false;
-    } else if (isalpha(ch)) {
-      ungetc(ch, file);
-      if (!LoadTokenWord(file, &line, include))
-        return false;
-    } else if (strchr("+-.0123456789", ch)) {
-      ungetc(ch, file);
-      if (!LoadTokenNum(file, &line, include))
-        return false;
-    } else if (isblank(ch)) {
-      ungetc(ch, file);
-      if (!LoadTokenSpace(file, &line, include))
-        return false;
-    } else if (ch == '"') {
-      ungetc(ch, file);
-      if (!LoadTokenString(file, &line, include))
-        return false;
-    } else if (strchr("(", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenOpenEntity, token, include);
-    } else if (strchr(")", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenCloseEntity, token, include);
-    } else if (strchr("[", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenOpenTuple, token, include);
-    } else if (strchr("]", ch)) {
-      token[0] = ch;
-      token[1] = 0;
-      AddToken(TokenCloseTuple, token, include);
-    } else if (0x0d == ch) {
-      ch = fgetc(file);
-      if (0x0a != ch)
-        ungetc(ch, file);
-      line++;
-      AddToken(TokenEOL, "\n", include);
-    } else if (0x0a == ch) {
-      ch = fgetc(file);
-      if (0x0d != ch)
-        ungetc(ch, file);
-      line++;
-      AddToken(TokenEOL, "\n", include);
-    } else {
-      TOKEN_ERR("syntax error", line);
-      return false;
-    }
+  if (fclose(file) != 0 || !ok) {
+    PRINT_ERR2("unable to save compiled world file %s : %s", filename.c_str(), strerror(errno));
+    return false;
   }
 
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Read in a comment token
-bool Worldfile::LoadTokenComment(FILE *file, int *, int include)
+// Returns true iff the loaded file is a compiled world
+bool Worldfile::IsCompiled() const
 {
-  char token[256];
+  return !texts.empty()
+         && texts.front().compare(0, sizeof(COMPILED_MAGIC), COMPILED_MAGIC,
+                                  sizeof(COMPILED_MAGIC)) == 0;
+}
 
-  int len = 0;
-  memset(token, 0, sizeof(token));
+///////////////////////////////////////////////////////////////////////////
+// Build the entities and properties from a compiled world. The value
+// tokens refer to the strings in the file's text.
+bool Worldfile::LoadCompiled()
+{
+  const std::string &text = texts.front();
+  const char *p = text.data() + sizeof(COMPILED_MAGIC);
+  const char *end = text.data() + text.size();
 
-  while (true) {
-    int ch = fgetc(file);
+  ClearProperties();
+  ClearEntities();
 
-    if (ch == EOF) {
-      AddToken(TokenComment, token, include);
-      return true;
-    } else if (0x0a == ch || 0x0d == ch) {
-      ungetc(ch, file);
-      AddToken(TokenComment, token, include);
-      return true;
-    } else
-      token[len++] = ch;
+  uint32_t version = 0;
+  if (!read_value(&p, end, version) || version != COMPILED_VERSION) {
+    PRINT_ERR2("%s : unsupported compiled world version %u", this->filename.c_str(), version);
+    return false;
   }
-  return true;
-}
 
-bool Worldfile::LoadTokenComment(std::istream &content, int *, int include)
-{
-  char token[256];
+  // find the strings, which are zero-terminated in the file
+  uint32_t count = 0;
+  bool ok = read_value(&p, end, count);
 
-  int len = 0;
-  memset(token, 0, sizeof(token));
+  std::vector<std::pair<const char *, uint32_t> > strings(ok ? count : 0);
+  FOR_EACH (it, strings) {
+    ok = ok && read_value(&p, end, it->second) && (size_t)(end - p) > it->second
+         && p[it->second] == 0;
+    if (!ok)
+      break;
+    it->first = p;
+    p += it->second + 1;
+  }
 
-  while (true) {
-    int ch = content.get();
+  ok = ok && read_value(&p, end, count);
 
-    if (ch == EOF) {
-      AddToken(TokenComment, token, include);
-      return true;
-    } else if (0x0a == ch || 0x0d == ch) {
-      content.putback(ch);
-      AddToken(TokenComment, token, include);
-      return true;
-    } else
-      token[len++] = ch;
+  for (uint32_t i = 0; ok && i < count; i++) {
+    int32_t parent;
+    uint32_t type;
+
+    ok = read_value(&p, end, parent) && read_value(&p, end, type) && parent < (int32_t)i
+         && type < strings.size();
+    if (ok)
+      AddEntity(parent, strings[type].first);
   }
-  return true;
-}
-///////////////////////////////////////////////////////////////////////////
-// Read in a word token
-bool Worldfile::LoadTokenWord(FILE *file, int *line, int include)
-{
-  char token[256];
 
-  int len = 0;
-  memset(token, 0, sizeof(token));
+  ok = ok && read_value(&p, end, count);
 
-  while (true) {
-    int ch = fgetc(file);
+  for (uint32_t i = 0; ok && i < count; i++) {
+    int32_t entity, line;
+    uint32_t name, values;
 
-    if (ch == EOF) {
-      AddToken(TokenWord, token, include);
-      return true;
-    } else if (isalpha(ch) || isdigit(ch) || strchr(".-_[]", ch)) {
-      token[len++] = ch;
-    } else {
-      if (strcmp(token, "include") == 0) {
-        ungetc(ch, file);
-        AddToken(TokenWord, token, include);
-        if (!LoadTokenInclude(file, line, include))
-          return false;
-      } else {
-        ungetc(ch, file);
-        AddToken(TokenWord, token, include);
+    ok = read_value(&p, end, entity) && read_value(&p, end, line) && read_value(&p, end, name)
+         && read_value(&p, end, values) && entity >= 0 && entity < (int32_t)entities.size()
+         && name < strings.size();
+    if (!ok)
+      break;
+
+    CProperty *property = AddProperty(entity, strings[name].first, line);
+
+    for (uint32_t v = 0; ok && v < values; v++) {
+      uint8_t type;
+      uint32_t value;
+
+      ok = read_value(&p, end, type) && read_value(&p, end, value) && value < strings.size();
+      if (ok) {
+        AddToken(type, strings[value].first, strings[value].second, 0);
+        AddPropertyValue(property, v, tokens.size() - 1);
       }
-      return true;
     }
   }
-  assert(false);
-  return false;
+
+  if (!ok || p != end) {
+    PRINT_ERR1("%s : corrupt compiled world file", this->filename.c_str());
+    return false;
+  }
+
+  return true;
 }
 
-bool Worldfile::LoadTokenWord(std::istream &content, int *line, int include)
+///////////////////////////////////////////////////////////////////////////
+// Check for unused properties and print warnings
+bool Worldfile::WarnUnused()
 {
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
+  bool unused = false;
 
-  while (true) {
-    int ch = content.get();
+  FOR_EACH (ent, entities)
+    FOR_EACH (it, ent->properties) {
+      if (!it->second->used) {
+        PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
+                    this->filename.c_str(), it->second->line, it->second->name.c_str());
+        unused = true;
+      }
+    }
 
-    if (ch == EOF) {
-      AddToken(TokenWord, token, include);
-      return true;
-    } else if (isalpha(ch) || isdigit(ch) || strchr(".-_[]", ch)) {
-      token[len++] = ch;
-    } else {
-      if (strcmp(token, "include") == 0) {
-        content.putback(ch);
-        AddToken(TokenWord, token, include);
-        if (!LoadTokenInclude(content, line, include))
-          return false;
-      } else {
-        content.putback(ch);
-        AddToken(TokenWord, token, include);
+  FOR_EACH (proto, prototypes)
+    FOR_EACH (it, proto->properties) {
+      if (!it->second->used) {
+        PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
+                    this->filename.c_str(), it->second->line, it->second->name.c_str());
+        unused = true;
       }
-      return true;
     }
-  }
-  assert(false);
-  return false;
+
+  return unused;
 }
+
 ///////////////////////////////////////////////////////////////////////////
-// Load an include token; this will load the include file.
-bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
+// Read the whole of a file into a new text buffer.
+bool Worldfile::LoadText(FILE *file)
 {
-  const char *filename;
-  char *fullpath;
+  texts.push_back(std::string());
+  std::string &text = texts.back();
 
-  int ch = fgetc(file);
+  char buf[65536];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+    text.append(buf, len);
 
-  if (ch == EOF) {
-    TOKEN_ERR("incomplete include statement", *line);
-    return false;
-  } else if (!isblank(ch)) {
-    TOKEN_ERR("syntax error in include statement", *line);
-    return false;
-  }
+  return !ferror(file);
+}
 
-  ungetc(ch, file);
-  if (!LoadTokenSpace(file, line, include))
-    return false;
+// the characters that may appear in a number token
+static inline bool isnumchar(int ch)
+{
+  return ch && strchr("+-.0123456789", ch);
+}
 
-  ch = fgetc(file);
+// the characters that may appear in a word token after the first
+static inline bool iswordchar(int ch)
+{
+  return isalpha(ch) || isdigit(ch) || (ch && strchr(".-_[]", ch));
+}
 
-  if (ch == EOF) {
-    TOKEN_ERR("incomplete include statement", *line);
-    return false;
-  } else if (ch != '"') {
-    TOKEN_ERR("syntax error in include statement", *line);
-    return false;
-  }
+///////////////////////////////////////////////////////////////////////////
+// Load tokens from the most recently loaded text buffer. The tokens
+// refer to the buffer's contents rather than copying them.
+bool Worldfile::LoadTokens(int include)
+{
+  const std::string &text = texts.back();
+  const char *p = text.data();
+  const char *end = p + text.size();
 
-  ungetc(ch, file);
-  if (!LoadTokenString(file, line, include))
-    return false;
+  int line = 1;
 
-  // This is the basic filename
-  filename = GetTokenValue(this->tokens.size() - 1);
+  while (p < end) {
+    const unsigned char ch = *p;
+    const char *start = p;
 
-  // Now do some manipulation.  If its a relative path,
-  // we append the path of the world file.
-  if (filename[0] == '/' || filename[0] == '~') {
-    fullpath = strdup(filename);
-  } else if (this->filename[0] == '/' || this->filename[0] == '~') {
-    // Note that dirname() modifies the contents, so
-    // we need to make a copy of the filename.
-    // There's no bounds-checking, but what the heck.
-    char *tmp = strdup(this->filename.c_str());
-    fullpath = new char[PATH_MAX];
-    memset(fullpath, 0, PATH_MAX);
-    strcat(fullpath, dirname(tmp));
-    strcat(fullpath, "/");
-    strcat(fullpath, filename);
-    assert(strlen(fullpath) + 1 < PATH_MAX);
-    free(tmp);
-  } else {
-    // Note that dirname() modifies the contents, so
-    // we need to make a copy of the filename.
-    // There's no bounds-checking, but what the heck.
-    char *tmp = strdup(this->filename.c_str());
-    fullpath = new char[PATH_MAX];
-    char *dummy = getcwd(fullpath, PATH_MAX);
-    if (!dummy) {
-      PRINT_ERR2("unable to get cwd %d: %s", errno, strerror(errno));
-      if (tmp)
-        free(tmp);
-      delete[] fullpath;
+    if (ch == '#') {
+      while (p < end && *p != 0x0a && *p != 0x0d)
+        p++;
+      AddToken(TokenComment, start, p - start, include);
+    } else if (isalpha(ch)) {
+      while (p < end && iswordchar((unsigned char)*p))
+        p++;
+      AddToken(TokenWord, start, p - start, include);
+      if (p - start == 7 && strncmp(start, "include", 7) == 0)
+        if (!LoadTokenInclude(&p, end, &line, include))
+          return false;
+    } else if (isnumchar(ch)) {
+      while (p < end && isnumchar((unsigned char)*p))
+        p++;
+      AddToken(TokenNum, start, p - start, include);
+    } else if (isblank(ch)) {
+      while (p < end && isblank((unsigned char)*p))
+        p++;
+      AddToken(TokenSpace, start, p - start, include);
+    } else if (ch == '"') {
+      if (!LoadTokenString(&p, end, &line, include))
+        return false;
+    } else if (ch == '(') {
+      AddToken(TokenOpenEntity, p++, 1, include);
+    } else if (ch == ')') {
+      AddToken(TokenCloseEntity, p++, 1, include);
+    } else if (ch == '[') {
+      AddToken(TokenOpenTuple, p++, 1, include);
+    } else if (ch == ']') {
+      AddToken(TokenCloseTuple, p++, 1, include);
+    } else if (0x0d == ch || 0x0a == ch) {
+      // accept either order of CR and LF as a single line ending
+      if (++p < end && (*p == 0x0d || *p == 0x0a) && (unsigned char)*p != ch)
+        p++;
+      line++;
+      AddToken(TokenEOL, "\n", 1, include);
+    } else {
+      TOKEN_ERR("syntax error", line);
       return false;
     }
-    strcat(fullpath, "/");
-    strcat(fullpath, dirname(tmp));
-    strcat(fullpath, "/");
-    strcat(fullpath, filename);
-    assert(strlen(fullpath) + 1 < PATH_MAX);
-    free(tmp);
   }
 
-  printf("[Include %s]", filename);
-  fflush(stdout);
-
-  // Open the include file
-  FILE *infile = FileOpen(fullpath, "r");
-  if (!infile) {
-    PRINT_ERR2("unable to open include file %s : %s", fullpath, strerror(errno));
-    // free(fullpath);
-    delete[] fullpath;
-    return false;
-  }
-
-  // Terminate the include line
-  AddToken(TokenEOL, "\n", include);
-
-  // DumpTokens();
-
-  // Read tokens from the file
-  if (!LoadTokens(infile, include + 1)) {
-    fclose(infile);
-    // DumpTokens();
-    // free(fullpath);
-    delete[] fullpath;
-    return false;
-  }
-
-  // done with the include file
-  fclose(infile);
-
-  // consume the rest of the include line XX a bit of a hack - assumes
-  // that an include is the last thing on a line
-  while (ch != '\n')
-    ch = fgetc(file);
-
-  delete[] fullpath;
   return true;
 }
 
-bool Worldfile::LoadTokenInclude(std::istream &content, int *line, int include)
+///////////////////////////////////////////////////////////////////////////
+// Load an include token; this will load the include file.
+bool Worldfile::LoadTokenInclude(const char **p, const char *end, int *line, int include)
 {
-  const char *filename;
   char *fullpath;
 
-  int ch = content.get();
-
-  if (ch == EOF) {
+  if (*p == end) {
     TOKEN_ERR("incomplete include statement", *line);
     return false;
-  } else if (!isblank(ch)) {
+  } else if (!isblank((unsigned char)**p)) {
     TOKEN_ERR("syntax error in include statement", *line);
     return false;
   }
 
-  content.putback(ch);
-  if (!LoadTokenSpace(content, line, include))
-    return false;
-
-  ch = content.get();
+  const char *start = *p;
+  while (*p < end && isblank((unsigned char)**p))
+    (*p)++;
+  AddToken(TokenSpace, start, *p - start, include);
 
-  if (ch == EOF) {
+  if (*p == end) {
     TOKEN_ERR("incomplete include statement", *line);
     return false;
-  } else if (ch != '"') {
+  } else if (**p != '"') {
     TOKEN_ERR("syntax error in include statement", *line);
     return false;
   }
 
-  content.putback(ch);
-  if (!LoadTokenString(content, line, include))
+  if (!LoadTokenString(p, end, line, include))
     return false;
 
   // This is the basic filename
-  filename = GetTokenValue(this->tokens.size() - 1);
+  const std::string name = GetTokenValue(this->tokens.size() - 1);
+  const char *filename = name.c_str();
 
   // Now do some manipulation.  If its a relative path,
   // we append the path of the world file.
   if (filename[0] == '/' || filename[0] == '~') {
-    fullpath = strdup(filename);
+    fullpath = new char[PATH_MAX];
+    memset(fullpath, 0, PATH_MAX);
+    strncpy(fullpath, filename, PATH_MAX - 1);
   } else if (this->filename[0] == '/' || this->filename[0] == '~') {
     // Note that dirname() modifies the contents, so
     // we need to make a copy of the filename.
@@ -683,21 +663,16 @@ bool Worldfile::LoadTokenInclude(std::istream &content, int *line, int include)
   FILE *infile = FileOpen(fullpath, "r");
   if (!infile) {
     PRINT_ERR2("unable to open include file %s : %s", fullpath, strerror(errno));
-    // free(fullpath);
     delete[] fullpath;
     return false;
   }
 
   // Terminate the include line
-  AddToken(TokenEOL, "\n", include);
-
-  // DumpTokens();
+  AddToken(TokenEOL, "\n", 1, include);
 
-  // Read tokens from the file
-  if (!LoadTokens(infile, include + 1)) {
+  // Read the include file and its tokens
+  if (!LoadText(infile) || !LoadTokens(include + 1)) {
     fclose(infile);
-    // DumpTokens();
-    // free(fullpath);
     delete[] fullpath;
     return false;
   }
@@ -707,165 +682,35 @@ bool Worldfile::LoadTokenInclude(std::istream &content, int *line, int include)
 
   // consume the rest of the include line XX a bit of a hack - assumes
   // that an include is the last thing on a line
-  while (ch != '\n')
-    ch = content.get();
+  while (*p < end && *(*p)++ != '\n')
+    ;
+  (*line)++;
 
   delete[] fullpath;
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Read in a number token
-bool Worldfile::LoadTokenNum(FILE *file, int *, int include)
-{
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true) {
-    int ch = fgetc(file);
-
-    if (ch == EOF) {
-      AddToken(TokenNum, token, include);
-      return true;
-    } else if (strchr("+-.0123456789", ch)) {
-      token[len++] = ch;
-    } else {
-      AddToken(TokenNum, token, include);
-      ungetc(ch, file);
-      return true;
-    }
-  }
-  assert(false);
-  return false;
-}
-bool Worldfile::LoadTokenNum(std::istream &content, int *, int include)
+// Read in a string token. The token's value excludes the quotes.
+bool Worldfile::LoadTokenString(const char **p, const char *end, int *line, int include)
 {
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
+  const char *start = ++(*p); // skip the opening quote
 
   while (true) {
-    int ch = content.get();
-
-    if (ch == EOF) {
-      AddToken(TokenNum, token, include);
-      return true;
-    } else if (strchr("+-.0123456789", ch)) {
-      token[len++] = ch;
-    } else {
-      AddToken(TokenNum, token, include);
-      content.putback(ch);
-      return true;
-    }
-  }
-  assert(false);
-  return false;
-}
-///////////////////////////////////////////////////////////////////////////
-// Read in a string token
-bool Worldfile::LoadTokenString(FILE *file, int *line, int include)
-{
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
-
-  int ch = fgetc(file);
-
-  while (true) {
-    ch = fgetc(file);
-
-    if (EOF == ch || 0x0a == ch || 0x0d == ch) {
+    if (*p == end || 0x0a == **p || 0x0d == **p) {
       TOKEN_ERR("unterminated string constant", *line);
       return false;
-    } else if (ch == '"') {
-      AddToken(TokenString, token, include);
-      return true;
-    } else {
-      token[len++] = ch;
-    }
-  }
-  assert(false);
-  return false;
-}
-bool Worldfile::LoadTokenString(std::istream &content, int *line, int include)
-{
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
-
-  int ch = content.get();
-
-  while (true) {
-    ch = content.get();
-
-    if (EOF == ch || 0x0a == ch || 0x0d == ch) {
-      TOKEN_ERR("unterminated string constant", *line);
-      return false;
-    } else if (ch == '"') {
-      AddToken(TokenString, token, include);
-      return true;
-    } else {
-      token[len++] = ch;
-    }
-  }
-  assert(false);
-  return false;
-}
-///////////////////////////////////////////////////////////////////////////
-// Read in a whitespace token
-bool Worldfile::LoadTokenSpace(FILE *file, int *, int include)
-{
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true) {
-    int ch = fgetc(file);
-
-    if (ch == EOF) {
-      AddToken(TokenSpace, token, include);
-      return true;
-    } else if (isblank(ch)) {
-      token[len++] = ch;
-    } else {
-      AddToken(TokenSpace, token, include);
-      ungetc(ch, file);
+    } else if (**p == '"') {
+      AddToken(TokenString, start, *p - start, include);
+      (*p)++;
       return true;
-    }
+    } else
+      (*p)++;
   }
   assert(false);
   return false;
 }
-bool Worldfile::LoadTokenSpace(std::istream &content, int *, int include)
-{
-  char token[256];
-
-  int len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true) {
-    int ch = content.get();
 
-    if (ch == EOF) {
-      AddToken(TokenSpace, token, include);
-      return true;
-    } else if (isblank(ch)) {
-      token[len++] = ch;
-    } else {
-      AddToken(TokenSpace, token, include);
-      content.putback(ch);
-      return true;
-    }
-  }
-  assert(false);
-  return false;
-}
 ///////////////////////////////////////////////////////////////////////////
 // Save tokens to a file.
 bool Worldfile::SaveTokens(FILE *file)
@@ -873,12 +718,13 @@ bool Worldfile::SaveTokens(FILE *file)
   for (unsigned int i = 0; i < this->tokens.size(); i++) {
     CToken *token = &this->tokens[i];
 
-    if (token->include > 0)
+    // skip tokens from include files, and values made by the parser
+    if (token->include != 0)
       continue;
     if (token->type == TokenString)
-      fprintf(file, "\"%s\"", token->value.c_str());
+      fprintf(file, "\"%.*s\"", (int)token->length, token->value);
     else
-      fprintf(file, "%s", token->value.c_str());
+      fprintf(file, "%.*s", (int)token->length, token->value);
   }
   return true;
 }
@@ -888,13 +734,14 @@ bool Worldfile::SaveTokens(FILE *file)
 void Worldfile::ClearTokens()
 {
   tokens.clear();
+  texts.clear();
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a token to the token list
-bool Worldfile::AddToken(int type, const char *value, int include)
+bool Worldfile::AddToken(int type, const char *value, size_t length, int include)
 {
-  tokens.push_back(CToken(include, type, value));
+  tokens.push_back(CToken(include, type, value, length));
   return true;
 }
 
@@ -903,16 +750,20 @@ bool Worldfile::AddToken(int type, const char *value, int include)
 bool Worldfile::SetTokenValue(int index, const char *value)
 {
   assert(index >= 0 && index < (int)this->tokens.size());
-  tokens[index].value = value;
+  // the new value gets its own buffer, leaving the text it replaces
+  // as it was
+  texts.push_back(value);
+  tokens[index].value = texts.back().data();
+  tokens[index].length = texts.back().size();
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Get the value of a token
-const char *Worldfile::GetTokenValue(int index)
+std::string Worldfile::GetTokenValue(int index)
 {
   assert(index >= 0 && index < (int)this->tokens.size());
-  return this->tokens[index].value.c_str();
+  return std::string(this->tokens[index].value, this->tokens[index].length);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -928,10 +779,10 @@ void Worldfile::DumpTokens()
   FOR_EACH (it, tokens)
   // for (int i = 0; i < this->token_count; i++)
   {
-    if (it->value[0] == '\n')
+    if (it->type == TokenEOL)
       printf("[\\n]\n## %4d : %02d ", ++line, it->include);
     else
-      printf("[%s] ", it->value.c_str());
+      printf("[%.*s] ", (int)it->length, it->value);
   }
   printf("\n");
   printf("## end tokens\n");
@@ -944,22 +795,25 @@ bool Worldfile::ParseTokens()
   int entity;
   int line;
 
-  ClearEntities();
   ClearProperties();
+  ClearEntities();
 
   // Add in the "global" entity.
   entity = AddEntity(-1, "");
   line = 1;
 
-  for (int i = 0; i < (int)this->tokens.size(); i++) {
+  // instancing appends tokens for generated values; they are not parsed
+  const int count = this->tokens.size();
+
+  for (int i = 0; i < count; i++) {
     CToken *token = &this->tokens[0] + i;
 
     switch (token->type) {
     case TokenWord:
-      if (token->value == "include") {
+      if (token->Is("include")) {
         if (!ParseTokenInclude(&i, &line))
           return false;
-      } else if (token->value == "define") {
+      } else if (token->Is("define")) {
         if (!ParseTokenDefine(&i, &line))
           return false;
       } else {
@@ -1001,11 +855,9 @@ bool Worldfile::ParseTokenInclude(int *index, int *line)
 // Parse a macro definition
 bool Worldfile::ParseTokenDefine(int *index, int *line)
 {
-  const char *macroname, *entityname;
+  std::string macroname, entityname;
   int starttoken;
 
-  macroname = NULL;
-  entityname = NULL;
   starttoken = -1;
 
   for (int i = *index + 1, count = 0; i < (int)this->tokens.size(); i++) {
@@ -1014,9 +866,9 @@ bool Worldfile::ParseTokenDefine(int *index, int *line)
     switch (token->type) {
     case TokenWord:
       if (count == 0) {
-        if (macroname == NULL)
+        if (macroname.empty())
           macroname = GetTokenValue(i);
-        else if (entityname == NULL) {
+        else if (entityname.empty()) {
           entityname = GetTokenValue(i);
           starttoken = i;
         } else {
@@ -1024,11 +876,11 @@ bool Worldfile::ParseTokenDefine(int *index, int *line)
           return false;
         }
       } else {
-        if (macroname == NULL) {
+        if (macroname.empty()) {
           PARSE_ERR("missing name in macro definition", *line);
           return false;
         }
-        if (entityname == NULL) {
+        if (entityname.empty()) {
           PARSE_ERR("missing name in macro definition", *line);
           return false;
         }
@@ -1038,7 +890,7 @@ bool Worldfile::ParseTokenDefine(int *index, int *line)
     case TokenCloseEntity:
       count--;
       if (count == 0) {
-        AddMacro(macroname, entityname, *line, starttoken, i);
+        AddMacro(macroname.c_str(), entityname.c_str(), *line, starttoken, i);
         *index = i;
         return true;
       }
@@ -1080,10 +932,34 @@ bool Worldfile::ParseTokenWord(int entity, int *index, int *line)
 // Parse a entity from the token list.
 bool Worldfile::ParseTokenEntity(int entity, int *index, int *line)
 {
-  int name;
+  std::string type = GetTokenValue(*index);
+
+  // a count in brackets after the type, as in robot[100]( ... ), makes
+  // that many instances of the entity
+  const size_t bracket = type.find('[');
+  if (bracket == std::string::npos)
+    return ParseTokenEntityType(entity, type, index, line);
+
+  char *end;
+  const unsigned long count = strtoul(type.c_str() + bracket + 1, &end, 10);
+  if (count == 0 || strcmp(end, "]") != 0) {
+    PARSE_ERR("bad instance count", *line);
+    return false;
+  }
+  type.erase(bracket);
 
-  name = *index;
-  CMacro *macro = LookupMacro(GetTokenValue(name));
+  const int first = this->entities.size();
+  if (!ParseTokenEntityType(entity, type, index, line))
+    return false;
+
+  return Instantiate(first, count, *line);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Parse the body of an entity of the given type from the token list.
+bool Worldfile::ParseTokenEntityType(int entity, const std::string &type, int *index, int *line)
+{
+  CMacro *macro = LookupMacro(type.c_str());
 
   // If the entity name is a macro...
   if (macro) {
@@ -1119,7 +995,7 @@ bool Worldfile::ParseTokenEntity(int entity, int *index, int *line)
       CToken *token = &this->tokens[i];
 
       switch (token->type) {
-      case TokenOpenEntity: entity = AddEntity(entity, GetTokenValue(name)); break;
+      case TokenOpenEntity: entity = AddEntity(entity, type.c_str()); break;
       case TokenWord:
         if (!ParseTokenWord(entity, &i, line))
           return false;
@@ -1136,6 +1012,166 @@ bool Worldfile::ParseTokenEntity(int entity, int *index, int *line)
   return false;
 }
 
+// splitmix64's mixing function
+static uint64_t mix64(uint64_t z)
+{
+  z = (z + 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// the n'th of a sequence of numbers in [0,1) that depends only on
+// seed, for placing instances the same way every time
+static double instance_random(uint64_t seed, uint64_t n)
+{
+  return (mix64(mix64(seed) ^ n) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Make instances of the entity just parsed. Its properties, and those
+// of its descendents, become prototypes that every instance shares,
+// so the instances cost only their entity records. These properties
+// of the prototype are read here to give each instance its own:
+//
+//   pose_generator "grid"   : place the instances in rows, the first at
+//                             the prototype's pose, spaced by
+//                             pose_spacing [dx dy] (default [1 1])
+//   pose_generator "random" : place the instances at random in
+//                             pose_area [xmin xmax ymin ymax], in a
+//                             way chosen by pose_seed (by default,
+//                             different for every group)
+//   name "bot"              : name the instances bot0, bot1, ...
+//   color_generator "hue"   : give the instances colors evenly spaced
+//                             around the color wheel
+bool Worldfile::Instantiate(int first, unsigned int count, int line)
+{
+  const int last = this->entities.size();
+  const int size = last - first;
+
+  for (int e = first; e < last; e++) {
+    // an entity that is already an instance, nested in this one,
+    // keeps the prototype it shares with its siblings
+    this->prototypes.push_back(CPrototype());
+    this->prototypes.back().properties.swap(this->entities[e].properties);
+    this->prototypes.back().next = this->entities[e].prototype;
+    FOR_EACH (it, this->prototypes.back().properties)
+      it->second->entity = -1; // shared
+    this->entities[e].prototype = this->prototypes.size() - 1;
+  }
+
+  for (unsigned int k = 1; k < count; k++)
+    for (int e = first; e < last; e++) {
+      const CEntity ent = this->entities[e];
+      const int parent = ent.parent >= first ? ent.parent + k * size : ent.parent;
+      this->entities[AddEntity(parent, ent.type.c_str())].prototype = ent.prototype;
+    }
+
+  // the pose of the first instance
+  double pose[4] = { 0, 0, 0, 0 };
+  if (CProperty *property = GetProperty(first, "pose"))
+    for (size_t i = 0; i < 4 && i < property->values.size(); i++)
+      pose[i] = atof(GetPropertyValue(property, i).c_str());
+
+  const std::string posegen = ReadString(first, "pose_generator", "");
+  double spacing[2] = { 1, 1 };
+  double area[4] = { pose[0], pose[0], pose[1], pose[1] };
+  uint64_t seed = 0;
+
+  if (posegen == "grid") {
+    if (PropertyExists(first, "pose_spacing"))
+      ReadTuple(first, "pose_spacing", 0, 2, "ff", &spacing[0], &spacing[1]);
+  } else if (posegen == "random") {
+    if (!PropertyExists(first, "pose_area")) {
+      PARSE_ERR("pose_generator \"random\" needs a pose_area", line);
+      return false;
+    }
+    ReadTuple(first, "pose_area", 0, 4, "ffff", &area[0], &area[1], &area[2], &area[3]);
+    seed = ReadInt(first, "pose_seed", first);
+  } else if (posegen != "") {
+    PARSE_ERR("unknown pose_generator", line);
+    return false;
+  }
+
+  const std::string colorgen = ReadString(first, "color_generator", "");
+  if (colorgen != "" && colorgen != "hue") {
+    PARSE_ERR("unknown color_generator", line);
+    return false;
+  }
+
+  const std::string name = ReadString(first, "name", "");
+  const unsigned int columns = ceil(sqrt((double)count));
+
+  for (unsigned int k = 0; k < count; k++) {
+    const int entity = first + k * size;
+    std::vector<std::string> values;
+    char buf[64];
+
+    if (posegen != "") {
+      double x, y;
+      if (posegen == "grid") {
+        x = pose[0] + (k % columns) * spacing[0];
+        y = pose[1] + (k / columns) * spacing[1];
+      } else {
+        x = area[0] + instance_random(seed, 2 * k) * (area[1] - area[0]);
+        y = area[2] + instance_random(seed, 2 * k + 1) * (area[3] - area[2]);
+      }
+
+      const double generated[4] = { x, y, pose[2], pose[3] };
+      for (int i = 0; i < 4; i++) {
+        snprintf(buf, sizeof(buf), "%.3f", generated[i]);
+        values.push_back(buf);
+      }
+      AddInstanceProperty(entity, "pose", line, values, TokenNum);
+      values.clear();
+    }
+
+    if (name != "") {
+      snprintf(buf, sizeof(buf), "%u", k);
+      values.push_back(name + buf);
+      AddInstanceProperty(entity, "name", line, values, TokenString);
+      values.clear();
+    }
+
+    if (colorgen == "hue") {
+      // hue to RGB at full saturation and value
+      const double h = 6.0 * k / count;
+      const double f = h - floor(h);
+      double rgb[3];
+      switch ((int)h) {
+      case 0: rgb[0] = 1; rgb[1] = f; rgb[2] = 0; break;
+      case 1: rgb[0] = 1 - f; rgb[1] = 1; rgb[2] = 0; break;
+      case 2: rgb[0] = 0; rgb[1] = 1; rgb[2] = f; break;
+      case 3: rgb[0] = 0; rgb[1] = 1 - f; rgb[2] = 1; break;
+      case 4: rgb[0] = f; rgb[1] = 0; rgb[2] = 1; break;
+      default: rgb[0] = 1; rgb[1] = 0; rgb[2] = 1 - f; break;
+      }
+      snprintf(buf, sizeof(buf), "#%02x%02x%02x", (int)(255 * rgb[0] + 0.5),
+               (int)(255 * rgb[1] + 0.5), (int)(255 * rgb[2] + 0.5));
+      values.push_back(buf);
+      AddInstanceProperty(entity, "color", line, values, TokenString);
+      values.clear();
+    }
+  }
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a property with values of its own to an instance
+void Worldfile::AddInstanceProperty(int entity, const char *name, int line,
+                                    const std::vector<std::string> &values, int type)
+{
+  CProperty *property = AddProperty(entity, name, line);
+  property->used = true; // the prototype's property may not be read
+
+  for (size_t i = 0; i < values.size(); i++) {
+    this->texts.push_back(values[i]);
+    AddToken(type, this->texts.back().data(), this->texts.back().size(), -1);
+    AddPropertyValue(property, i, this->tokens.size() - 1);
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Parse an property from the token list.
 bool Worldfile::ParseTokenProperty(int entity, int *index, int *line)
@@ -1148,17 +1184,17 @@ bool Worldfile::ParseTokenProperty(int entity, int *index, int *line)
 
     switch (token->type) {
     case TokenNum:
-      property = AddProperty(entity, GetTokenValue(name), *line);
+      property = AddProperty(entity, GetTokenValue(name).c_str(), *line);
       AddPropertyValue(property, 0, i);
       *index = i;
       return true;
     case TokenString:
-      property = AddProperty(entity, GetTokenValue(name), *line);
+      property = AddProperty(entity, GetTokenValue(name).c_str(), *line);
       AddPropertyValue(property, 0, i);
       *index = i;
       return true;
     case TokenOpenTuple:
-      property = AddProperty(entity, GetTokenValue(name), *line);
+      property = AddProperty(entity, GetTokenValue(name).c_str(), *line);
       if (!ParseTokenTuple(property, &i, line))
         return false;
       *index = i;
@@ -1239,7 +1275,7 @@ void Worldfile::DumpMacros()
       if (this->tokens[j].type == TokenEOL)
         printf("[\\n]");
       else
-        printf("[%s]", GetTokenValue(j));
+        printf("[%s]", GetTokenValue(j).c_str());
     }
     printf("\n");
   }
@@ -1315,20 +1351,15 @@ int Worldfile::LookupEntity(const char *type)
   return -1;
 }
 
-void PrintProp(const char *key, CProperty *prop)
-{
-  if (prop)
-    printf("Print key %s prop ent %d name %s\n", key, prop->entity, prop->name.c_str());
-}
-
 ///////////////////////////////////////////////////////////////////////////
 // Dump the entity list for debugging
 void Worldfile::DumpEntities()
 {
   printf("\n## begin entities\n");
 
-  FOR_EACH (it, properties)
-    PrintProp(it->first.c_str(), it->second);
+  for (size_t entity = 0; entity < entities.size(); entity++)
+    printf("## [%d][%d][%s]\n", (int)entity, entities[entity].parent,
+           entities[entity].type.c_str());
 
   printf("## end entities\n");
 }
@@ -1337,21 +1368,69 @@ void Worldfile::DumpEntities()
 // Clear the property list
 void Worldfile::ClearProperties()
 {
-  FOR_EACH (it, properties)
-    delete it->second;
-  properties.clear();
+  FOR_EACH (ent, entities) {
+    FOR_EACH (it, ent->properties)
+      delete it->second;
+    ent->properties.clear();
+  }
+
+  FOR_EACH (proto, prototypes)
+    FOR_EACH (it, proto->properties)
+      delete it->second;
+  prototypes.clear();
+
+  property_ids.clear();
+  property_names.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the id of a property name
+int Worldfile::LookupPropertyName(const char *name) const
+{
+  std::map<const char *, int, CStrLess>::const_iterator it = property_ids.find(name);
+  return it == property_ids.end() ? -1 : it->second;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the id of a property name, adding it if necessary
+int Worldfile::InternPropertyName(const char *name)
+{
+  int id = LookupPropertyName(name);
+
+  if (id < 0) {
+    id = property_names.size();
+    property_names.push_back(name);
+    property_ids.insert(std::make_pair(property_names.back().c_str(), id));
+  }
+
+  return id;
+}
+
+// orders an entity's properties by the ids of their names
+static bool property_id_less(const std::pair<int, CProperty *> &prop, int id)
+{
+  return prop.first < id;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Add an property
 CProperty *Worldfile::AddProperty(int entity, const char *name, int line)
 {
-  char key[128];
-  snprintf(key, 127, "%d%s", entity, name);
+  assert(entity >= 0 && entity < (int)this->entities.size());
 
+  const int id = InternPropertyName(name);
   CProperty *property = new CProperty(entity, name, line);
 
-  properties[key] = property;
+  std::vector<std::pair<int, CProperty *> > &props = this->entities[entity].properties;
+  std::vector<std::pair<int, CProperty *> >::iterator it =
+      std::lower_bound(props.begin(), props.end(), id, property_id_less);
+
+  if (it != props.end() && it->first == id) {
+    // a later definition replaces an earlier one, e.g. from a macro
+    delete it->second;
+    it->second = property;
+  } else
+    props.insert(it, std::make_pair(id, property));
 
   return property;
 }
@@ -1374,28 +1453,66 @@ void Worldfile::AddPropertyValue(CProperty *property, int index, int value_token
 // Get an property
 CProperty *Worldfile::GetProperty(int entity, const char *name)
 {
-  char key[128];
-  snprintf(key, 127, "%d%s", entity, name);
+  if (entity < 0 || entity >= (int)this->entities.size())
+    return NULL;
 
-  // printf( "looking up key %s for entity %d name %s\n", key, entity, name );
+  const int id = LookupPropertyName(name);
+  if (id < 0) // no entity has this property
+    return NULL;
 
-  static char cache_key[128] = { 0 };
-  static CProperty *cache_property = NULL;
+  const CEntity &ent = this->entities[entity];
+  std::vector<std::pair<int, CProperty *> >::const_iterator it =
+      std::lower_bound(ent.properties.begin(), ent.properties.end(), id, property_id_less);
 
-  if (strncmp(key, cache_key, 128) != 0) // different to last time
-  {
-    strncpy(cache_key, key, 128); // remember for next time
+  if (it != ent.properties.end() && it->first == id)
+    return it->second;
 
-    std::map<std::string, CProperty *>::iterator it = properties.find(key);
-    if (it == properties.end()) // not found
-      cache_property = NULL;
-    else
-      cache_property = it->second;
+  // an instance shares the rest of its properties
+  for (int proto = ent.prototype; proto >= 0; proto = this->prototypes[proto].next) {
+    const std::vector<std::pair<int, CProperty *> > &props = this->prototypes[proto].properties;
+    it = std::lower_bound(props.begin(), props.end(), id, property_id_less);
+
+    if (it != props.end() && it->first == id)
+      return it->second;
+  }
+
+  return NULL; // not found
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get an property to write to
+CProperty *Worldfile::GetWritableProperty(int entity, const char *name)
+{
+  CProperty *property = GetProperty(entity, name);
+  if (property == NULL || property->entity == entity)
+    return property;
+
+  // the property is shared with other instances, so copy it
+  CProperty *copy = AddProperty(entity, name, property->line);
+  for (size_t i = 0; i < property->values.size(); i++) {
+    const CToken token = this->tokens[property->values[i]];
+    AddToken(token.type, token.value, token.length, -1);
+    AddPropertyValue(copy, i, this->tokens.size() - 1);
   }
-  // else
-  // printf( "cache hit with %s\n", cache_key );
+  copy->used = property->used;
+
+  return copy;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get all the properties of an entity, shared or not
+void Worldfile::GetEntityProperties(int entity,
+                                    std::vector<std::pair<int, CProperty *> > &properties)
+{
+  properties = this->entities[entity].properties;
 
-  return cache_property;
+  for (int proto = this->entities[entity].prototype; proto >= 0;
+       proto = this->prototypes[proto].next)
+    FOR_EACH (it, this->prototypes[proto].properties)
+      if (GetProperty(entity, it->second->name.c_str()) == it->second) // not overridden
+        properties.push_back(*it);
+
+  std::sort(properties.begin(), properties.end());
 }
 
 bool Worldfile::PropertyExists(int section, const char *token)
@@ -1418,7 +1535,7 @@ void Worldfile::SetPropertyValue(CProperty *property, int index, const char *val
 
 ///////////////////////////////////////////////////////////////////////////
 // Get the value of an property
-const char *Worldfile::GetPropertyValue(CProperty *property, int index)
+std::string Worldfile::GetPropertyValue(CProperty *property, int index)
 {
   assert(property);
   property->used = true;
@@ -1430,18 +1547,20 @@ const char *Worldfile::GetPropertyValue(CProperty *property, int index)
 void Worldfile::DumpProperties()
 {
   printf("\n## begin properties\n");
-  //   for (int i = 0; i < this->property_count; i++)
-  //   {
-  //     CProperty *property = this->properties + i;
-  //     CEntity *entity = this->entities + property->entity;
-
-  //     printf("## [%d]", property->entity);
-  //     printf("[%s]", entity->type);
-  //     printf("[%s]", property->name);
-  //     for (int j = 0; j < property->value_count; j++)
-  //       printf("[%s]", GetTokenValue(property->values[j]));
-  //     printf("\n");
-  //   }
+
+  for (size_t entity = 0; entity < entities.size(); entity++) {
+    std::vector<std::pair<int, CProperty *> > properties;
+    GetEntityProperties(entity, properties);
+
+    FOR_EACH (it, properties) {
+      printf("## [%d][%s][%s]", (int)entity, entities[entity].type.c_str(),
+             it->second->name.c_str());
+      FOR_EACH (vit, it->second->values)
+        printf("[%s]", GetTokenValue(*vit).c_str());
+      printf("\n");
+    }
+  }
+
   printf("## end properties\n");
 }
 
@@ -1459,7 +1578,7 @@ const std::string Worldfile::ReadString(int entity, const char *name, const std:
 // Write a string
 void Worldfile::WriteString(int entity, const char *name, const std::string &value)
 {
-  CProperty *property = GetProperty(entity, name);
+  CProperty *property = GetWritableProperty(entity, name);
   if (property == NULL)
     return;
   SetPropertyValue(property, 0, value.c_str());
@@ -1472,7 +1591,7 @@ int Worldfile::ReadInt(int entity, const char *name, int value)
   CProperty *property = GetProperty(entity, name);
   if (property == NULL)
     return value;
-  return atoi(GetPropertyValue(property, 0));
+  return atoi(GetPropertyValue(property, 0).c_str());
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1505,66 +1624,48 @@ double Worldfile::ReadFloat(int entity, const char *name, double value)
   CProperty *property = GetProperty(entity, name);
   if (property == NULL)
     return value;
-  return atof(GetPropertyValue(property, 0));
+  return atof(GetPropertyValue(property, 0).c_str());
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // Read a file name
 // Always returns an absolute path.
 // If the filename is entered as a relative path, we prepend
-// the world files path to it.
-// Known bug: will leak memory everytime it is called (but its not called often,
-// so I cant be bothered fixing it).
+// the world files path to it. The path is kept with the token texts,
+// so it lives as long as the worldfile.
 const char *Worldfile::ReadFilename(int entity, const char *name, const char *value)
 {
   CProperty *property = GetProperty(entity, name);
   if (property == NULL)
     return value;
-  const char *filename = GetPropertyValue(property, 0);
+  const std::string filename = GetPropertyValue(property, 0);
 
+  std::string fullpath;
   if (filename[0] == '/' || filename[0] == '~')
-    return filename;
+    fullpath = filename;
+  else {
+    if (this->filename[0] != '/' && this->filename[0] != '~') {
+      // Prepend the path
+      char cwd[PATH_MAX];
+      if (!getcwd(cwd, PATH_MAX)) {
+        PRINT_ERR2("unable to get cwd %d: %s", errno, strerror(errno));
+        return value;
+      }
+      fullpath = cwd;
+      fullpath += "/";
+    }
 
-  else if (this->filename[0] == '/' || this->filename[0] == '~') {
     // Note that dirname() modifies the contents, so
     // we need to make a copy of the filename.
-    // There's no bounds-checking, but what the heck.
-    char *tmp = strdup(this->filename.c_str());
-    char *fullpath = new char[PATH_MAX];
-    memset(fullpath, 0, PATH_MAX);
-    strcat(fullpath, dirname(tmp));
-    strcat(fullpath, "/");
-    strcat(fullpath, filename);
-    assert(strlen(fullpath) + 1 < PATH_MAX);
-    if (tmp)
-      free(tmp);
-    return fullpath;
-  } else {
-    // Prepend the path
-    // Note that dirname() modifies the contents, so
-    // we need to make a copy of the filename.
-    // There's no bounds-checking, but what the heck.
     char *tmp = strdup(this->filename.c_str());
-    char *fullpath = new char[PATH_MAX];
-    char *dummy = getcwd(fullpath, PATH_MAX);
-    if (!dummy) {
-      PRINT_ERR2("unable to get cwd %d: %s", errno, strerror(errno));
-      if (fullpath)
-        delete[] fullpath;
-      if (tmp)
-        free(tmp);
-      return value;
-    }
-
-    strcat(fullpath, "/");
-    strcat(fullpath, dirname(tmp));
-    strcat(fullpath, "/");
-    strcat(fullpath, filename);
-    assert(strlen(fullpath) + 1 < PATH_MAX);
+    fullpath += dirname(tmp);
+    fullpath += "/";
+    fullpath += filename;
     free(tmp);
-
-    return fullpath;
   }
+
+  texts.push_back(fullpath);
+  return texts.back().c_str();
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1593,7 +1694,8 @@ int Worldfile::ReadTuple(const int entity, const char *name, const unsigned int
   va_start(args, format);
 
   for (unsigned int i = 0; i < count; i++) {
-    const char *val = GetPropertyValue(property, first + i);
+    const std::string val_str = GetPropertyValue(property, first + i);
+    const char *val = val_str.c_str();
 
     switch (format[i]) {
     case 'i': // signed integer
@@ -1635,7 +1737,7 @@ int Worldfile::ReadTuple(const int entity, const char *name, const unsigned int
 void Worldfile::WriteTuple(const int entity, const char *name, const unsigned int first,
                            const unsigned int count, const char *format, ...)
 {
-  CProperty *property = GetProperty(entity, name);
+  CProperty *property = GetWritableProperty(entity, name);
   if (property == NULL)
     return;
 
@@ -28,6 +28,8 @@
 #define WORLDFILE_HH
 
 #include <cstdio> // for FILE ops
+#include <cstring>
+#include <deque>
 #include <istream>
 #include <map>
 #include <stdint.h> // for portable int types eg. uint32_t
@@ -91,6 +93,23 @@ public:
 public:
   bool Save(const std::string &filename);
 
+  // Save the parsed world into a compiled file, which Load() reads
+  // without tokenizing or expanding macros. Color names are resolved
+  // to color_rgba tuples. Relative paths in the world are taken from
+  // the compiled file's directory when it is loaded.
+public:
+  bool SaveCompiled(const std::string &filename);
+
+  // Load a world file and save it compiled, as stage --compile
+  // does. A test file is compiled rather than dumped, so that the
+  // compiled file's dump can be checked against it.
+public:
+  bool Compile(const std::string &filename, const std::string &output);
+
+  // Returns true iff the loaded file is a compiled world
+public:
+  bool IsCompiled() const;
+
   // Check for unused properties and print warnings
 public:
   bool WarnUnused();
@@ -146,7 +165,7 @@ public:
 
   // Read a file name.  Always returns an absolute path.  If the
   // filename is entered as a relative path, we prepend the world
-  // files path to it.
+  // files path to it.  The string is owned by the worldfile.
 public:
   const char *ReadFilename(int entity, const char *name, const char *value);
 
@@ -163,54 +182,21 @@ public:
   ////////////////////////////////////////////////////////////////////////////
   // Private methods used to load stuff from the world file
 
-  // Load tokens from a file.
+  // Read the whole of a file into a new text buffer.
 private:
-  bool LoadTokens(FILE *file, int include);
-  // Load tokens from a stream.
-private:
-  bool LoadTokens(std::istream &content, int include);
+  bool LoadText(FILE *file);
 
-  // Read in a comment token
-private:
-  bool LoadTokenComment(FILE *file, int *line, int include);
-  // Read in a comment token (stream version)
+  // Load tokens from the most recently read text buffer.
 private:
-  bool LoadTokenComment(std::istream &content, int *line, int include);
-
-  // Read in a word token
-private:
-  bool LoadTokenWord(FILE *file, int *line, int include);
-  // Read in a word token (stream version)
-private:
-  bool LoadTokenWord(std::istream &content, int *line, int include);
+  bool LoadTokens(int include);
 
   // Load an include token; this will load the include file.
 private:
-  bool LoadTokenInclude(FILE *file, int *line, int include);
-  // Load an include token; this will load the include file (stream version)
-private:
-  bool LoadTokenInclude(std::istream &content, int *line, int include);
-
-  // Read in a number token
-private:
-  bool LoadTokenNum(FILE *file, int *line, int include);
-  // Read in a number token (stream version)
-private:
-  bool LoadTokenNum(std::istream &content, int *line, int include);
+  bool LoadTokenInclude(const char **p, const char *end, int *line, int include);
 
   // Read in a string token
 private:
-  bool LoadTokenString(FILE *file, int *line, int include);
-  // Read in a string token (stream version)
-private:
-  bool LoadTokenString(std::istream &content, int *line, int include);
-
-  // Read in a whitespace token
-private:
-  bool LoadTokenSpace(FILE *file, int *line, int include);
-  // Read in a whitespace token (stream version)
-private:
-  bool LoadTokenSpace(std::istream &content, int *line, int include);
+  bool LoadTokenString(const char **p, const char *end, int *line, int include);
 
   // Save tokens to a file.
 private:
@@ -222,7 +208,7 @@ private:
 
   // Add a token to the token list
 private:
-  bool AddToken(int type, const char *value, int include);
+  bool AddToken(int type, const char *value, size_t length, int include);
 
   // Set a token in the token list
 private:
@@ -230,7 +216,7 @@ private:
 
   // Get the value of a token
 private:
-  const char *GetTokenValue(int index);
+  std::string GetTokenValue(int index);
 
   // Dump the token list (for debugging).
 private:
@@ -240,6 +226,10 @@ private:
 private:
   bool ParseTokens();
 
+  // Build the entities and properties from a compiled world file
+private:
+  bool LoadCompiled();
+
   // Parse an include statement
 private:
   bool ParseTokenInclude(int *index, int *line);
@@ -256,6 +246,20 @@ private:
 private:
   bool ParseTokenEntity(int entity, int *index, int *line);
 
+  // Parse the body of an entity of the given type from the token list.
+private:
+  bool ParseTokenEntityType(int entity, const std::string &type, int *index, int *line);
+
+  // Turn the entity just parsed, which is the entity first and its
+  // descendents, into count instances that share its properties.
+private:
+  bool Instantiate(int first, unsigned int count, int line);
+
+  // Add a property to an instance with values of its own.
+private:
+  void AddInstanceProperty(int entity, const char *name, int line,
+                           const std::vector<std::string> &values, int type);
+
   // Parse an property from the token list.
 private:
   bool ParseTokenProperty(int entity, int *index, int *line);
@@ -319,6 +323,14 @@ private:
 private:
   void ClearProperties();
 
+  // Get the id of a property name, or -1 if no property has this name
+private:
+  int LookupPropertyName(const char *name) const;
+
+  // Get the id of a property name, adding the name if it is new
+private:
+  int InternPropertyName(const char *name);
+
   // Add an property
 private:
   CProperty *AddProperty(int entity, const char *name, int line);
@@ -330,8 +342,19 @@ private:
 public:
   CProperty *GetProperty(int entity, const char *name);
 
+  // Get an property to write to. If the entity shares the property
+  // with other instances it is given a copy of its own first.
+private:
+  CProperty *GetWritableProperty(int entity, const char *name);
+
+  // Get all the properties of an entity, including those it shares
+  // with other instances, ordered by the ids of their names.
+private:
+  void GetEntityProperties(int entity, std::vector<std::pair<int, CProperty *> > &properties);
+
   // returns true iff the property exists in the file, so that you can
   // be sure that GetProperty() will work
+public:
   bool PropertyExists(int section, const char *token);
 
   // Set the value of an property.
@@ -340,7 +363,7 @@ private:
 
   // Get the value of an property.
 public:
-  const char *GetPropertyValue(CProperty *property, int index);
+  std::string GetPropertyValue(CProperty *property, int index);
 
   // Dump the property list for debugging
 private:
@@ -371,10 +394,18 @@ private:
     // Token type (enumerated value).
     int type;
 
-    // Token value
-    std::string value;
+    // Token value. This is not zero-terminated: it points into one
+    // of the text buffers and is length characters long.
+    const char *value;
+    size_t length;
 
-    CToken(int include, int type, const char *value) : include(include), type(type), value(value) {}
+    CToken(int include, int type, const char *value, size_t length)
+        : include(include), type(type), value(value), length(length)
+    {
+    }
+
+    // Returns true iff the value of the token is the string s
+    bool Is(const char *s) const { return strncmp(value, s, length) == 0 && s[length] == 0; }
   };
 
   // A list of tokens loaded from the file.
@@ -383,6 +414,12 @@ private:
 private:
   std::vector<CToken> tokens;
 
+  // The text of the world file and its includes, which the tokens
+  // refer to, plus the values and file names written since. A deque never moves its
+  // elements, so the tokens stay valid as more text is added.
+private:
+  std::deque<std::string> texts;
+
   // Private macro class
 private:
   class CMacro {
@@ -420,16 +457,52 @@ private:
     // Type of entity (i.e. position, laser, etc).
     std::string type;
 
-    CEntity(int parent, const char *type) : parent(parent), type(type) {}
+    // This entity's properties and the ids of their names, sorted by
+    // id
+    std::vector<std::pair<int, CProperty *> > properties;
+
+    // For an instance, the index of the first prototype whose
+    // properties it shares, or -1. Its own properties take precedence.
+    int prototype;
+
+    CEntity(int parent, const char *type)
+        : parent(parent), type(type), properties(), prototype(-1)
+    {
+    }
   };
 
   // Entity list
 private:
   std::vector<CEntity> entities;
 
-  // Property list
+  // The properties shared by instances, in the same form as an
+  // entity's. Shared properties have entity -1. Instances nested in
+  // instances share a chain of prototypes, the innermost last.
+private:
+  class CPrototype {
+  public:
+    std::vector<std::pair<int, CProperty *> > properties;
+
+    // The prototype searched after this one, or -1
+    int next;
+
+    CPrototype() : properties(), next(-1) {}
+  };
+  std::vector<CPrototype> prototypes;
+
+  // Orders C strings by their contents
 private:
-  std::map<std::string, CProperty *> properties;
+  class CStrLess {
+  public:
+    bool operator()(const char *a, const char *b) const { return strcmp(a, b) < 0; }
+  };
+
+  // Every property name in the file, each stored once. A name's id
+  // is its index here. Lookups only read these, so properties can be
+  // read from several threads at once.
+private:
+  std::deque<std::string> property_names;
+  std::map<const char *, int, CStrLess> property_ids;
 
   // Name of the file we loaded
 public:
@@ -441,6 +514,10 @@ public:
 
 public:
   double unit_angle;
+
+  // True while Compile() is loading the file
+private:
+  bool compiling;
 };
 }
 
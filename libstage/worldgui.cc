@@ -466,8 +466,8 @@ void WorldGui::DrawOccupancy() const
 
   //  unsigned int layer( updates % 2 );
 
-  FOR_EACH (it, superregions)
-    it->second->DrawOccupancy();
+  FOR_EACH (it, superregions.All())
+    (*it)->DrawOccupancy();
 
   // 	 {
 
@@ -481,8 +481,8 @@ void WorldGui::DrawVoxels() const
 {
   unsigned int layer(updates % 2);
 
-  FOR_EACH (it, superregions)
-    it->second->DrawVoxels(layer);
+  FOR_EACH (it, superregions.All())
+    (*it)->DrawVoxels(layer);
 }
 
 void WorldGui::windowCb(Fl_Widget *, WorldGui *wg)
@@ -4,93 +4,117 @@
 # Author: Andrew Howard
 # Date; 6 Jun 2002
 # CVS: $Id: test.py,v 1.1 2002-06-07 16:28:40 inspectorg Exp $
+#
+# Usage: test.py <worldfile> [worldfile ...]
+#
+# Each world file sets "test 1", so that stage prints the entities
+# and properties it parsed, and then quits. The expected results are
+# listed at the bottom of the file. Files that load without errors
+# are also compiled with stage --compile, and the compiled file must
+# give the same results, or those listed under "compiled properties"
+# if the file has them. Properties may be listed in any order. The
+# stage to run is taken from $STAGE.
+
+from __future__ import print_function
 
 import os
-import string
+import re
+import subprocess
 import sys
+import tempfile
+
+STAGE = os.environ.get('STAGE', 'stage')
+
+QUIT = 'this is a test file; quitting'
+
+ERROR = '\033[41merr\033[0m: '
+
+
+def run_stage(args):
+    """Runs stage and returns its output, including errors, as lines."""
+
+    proc = subprocess.Popen([STAGE] + args, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT, universal_newlines=True)
+    output = proc.communicate()[0]
+    return output.splitlines()
 
 
 def test_file(filename):
-    """Runs stage with the given filename and validates the output."""
+    """Runs stage with the given filename and validates the output.
+    Returns the number of failures."""
+
+    a = read_lists(open(filename).read().splitlines())
+    b = read_lists(run_stage([filename]))
+
+    failures = 0
+    failures += check(filename, 'errors    ', a['errors'], b['errors'])
+    if failures:
+        return failures
+
+    failures += check(filename, 'entities  ', a['entities'], b['entities'])
+    failures += check(filename, 'properties', sorted(a['properties']),
+                      sorted(b['properties']))
+
+    # only a file that loads can be compiled
+    if a['errors'] != [QUIT]:
+        return failures
 
-    file = open(filename)
-    a = read_lists(file)
-    del file
+    fd, compiled = tempfile.mkstemp('.stgbin')
+    os.close(fd)
+    try:
+        run_stage(['--compile', filename, '-o', compiled])
+        c = read_lists(run_stage([compiled]))
+    finally:
+        os.remove(compiled)
 
-    file = os.popen('../../src/stage %s' % filename, 'r')
-    b = read_lists(file)
-    del file
+    expected = a['compiled properties'] or b['properties']
+    failures += check(filename, 'compiled entities  ', b['entities'], c['entities'])
+    failures += check(filename, 'compiled properties', sorted(expected),
+                      sorted(c['properties']))
 
-    print '%s : errors  ' % filename,
-    if compare_lists(a[2], b[2]) != 0:
-        print ': \033[41mfail\033[0m'
-        print_lists(a[2], b[2])
+    return failures
+
+
+def check(filename, what, la, lb):
+    """Compares the expected and actual lists and reports the result."""
+
+    print('%s : %s' % (filename, what), end=' ')
+    if la != lb:
+        print(': \033[41mfail\033[0m')
+        print_lists(la, lb)
         return 1
-    else:
-        print ': pass'        
-
-    print '%s : sections' % filename,
-    if compare_lists(a[0], b[0]) != 0:
-        print ': \033[41mfail\033[0m'
-        print_lists(a[0], b[0])
-    else:
-        print ': pass'        
-
-    print '%s : items   ' % filename,
-    if compare_lists(a[1], b[1]) != 0:
-        print ': \033[41mfail\033[0m'
-        print_lists(a[1], b[1])
-    else:
-        print ': pass'        
 
+    print(': pass')
     return 0
 
 
-def read_lists(file):
-    """Read and return the various lists from a file object."""
-    
-    list = None
-    sections = []
-    items = []
-    errors = []
+def read_lists(lines):
+    """Read and return the various lists from lines of text."""
 
-    while 1:
+    lists = {'entities': [], 'properties': [], 'compiled properties': [],
+             'errors': []}
+    current = None
 
-        line = file.readline()
-        if not line:
-            break
-        bits = string.split(line)
+    for line in lines:
+        bits = line.split()
         if not bits:
             continue
         if bits[0] == '##':
-            if bits[1] == 'begin':
-                if bits[2] == 'sections':
-                    list = sections
-                elif bits[2] == 'items':
-                    list = items
-            elif bits[1] == 'end':
-                list = None
-            elif bits[1] == 'stage' and bits[2] == 'error':
-                errors.append(string.join(bits[4:]))
-            elif list != None:
-                list.append(string.join(bits[1:]))
-        elif bits[0] == 'stage' and bits[1] == 'error':
-            errors.append(string.join(bits[3:]))
-        
-    return (sections, items, errors)
-
-
-def compare_lists(la, lb):
-    """Compare two lists."""
-
-    if len(la) != len(lb):
-        return 1
-    for i in range(0, len(la)):
-        sa = la[i]
-        sb = lb[i]
-        if sa != sb:
-            return 1
-    return 0
+            if len(bits) > 2 and bits[1] == 'begin':
+                current = lists.get(' '.join(bits[2:]))
+            elif len(bits) > 1 and bits[1] == 'end':
+                current = None
+            elif len(bits) > 2 and bits[1] == 'stage' and bits[2] == 'error':
+                lists['errors'].append(' '.join(bits[6:]))
+            elif current is not None:
+                current.append(' '.join(bits[1:]))
+        elif ERROR in line:
+            # drop any output before the error, the color and the
+            # source location
+            message = line[line.index(ERROR) + len(ERROR):]
+            lists['errors'].append(re.sub(r' \([^()]*\)$', '', message))
+
+    return lists
 
 
 def print_lists(la, lb):
@@ -106,27 +130,24 @@ def print_lists(la, lb):
         else:
             sb = ''
         if sa == sb:
-            print sa
-            print sb
+            print(sa)
+            print(sb)
         else:
-            print '\033[42m' + sa + '\33[K\033[0m'
-            print '\033[41m' + sb + '\33[K\033[0m'
+            print('\033[42m' + sa + '\33[K\033[0m')
+            print('\033[41m' + sb + '\33[K\033[0m')
     return
 
 
-
-
 def main(argv):
     """Run the tests."""
 
+    failures = 0
     for test in argv[1:]:
-        test_file(test)
-
-    return
-
+        failures += test_file(test)
 
+    return failures != 0
 
 
 if __name__ == '__main__':
 
-    main(sys.argv)
+    sys.exit(main(sys.argv))